@@ -0,0 +1,387 @@
+#include "AudioBackend.h"
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstdlib>
+#include <mutex>
+#include <thread>
+
+#if defined(_WIN32)
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#include <mmsystem.h>
+#pragma comment(lib, "winmm.lib")
+#elif defined(__linux__) && __has_include(<alsa/asoundlib.h>)
+#define SYNTH_ALSA
+#include <alsa/asoundlib.h>	// link with -lasound
+#endif
+
+namespace Synth
+{
+	namespace
+	{
+		void writeLE(std::ostream& os, const uint32_t nValue, const int nBytes)
+		{
+			for (int i = 0; i < nBytes; ++i)
+				os.put(static_cast<char>((nValue >> (8 * i)) & 0xff));
+		}
+
+#if defined(_WIN32)
+		class WinMMAudioBackend : public AudioBackend
+		{
+		public:
+			explicit WinMMAudioBackend(const unsigned int nDeviceID) : m_nDeviceID(nDeviceID) {}
+			~WinMMAudioBackend() override { close(); }
+
+			bool open(const AudioFormat& format, const void* pBlockMemory) override
+			{
+				WAVEFORMATEX waveFormat;
+				waveFormat.wFormatTag = format.bFloat ? WAVE_FORMAT_IEEE_FLOAT : WAVE_FORMAT_PCM;
+				waveFormat.nSamplesPerSec = format.nSampleRate;
+				waveFormat.wBitsPerSample = static_cast<WORD>(format.nBitsPerSample);
+				waveFormat.nChannels = static_cast<WORD>(format.nChannels);
+				waveFormat.nBlockAlign = (waveFormat.wBitsPerSample / 8) * waveFormat.nChannels;
+				waveFormat.nAvgBytesPerSec = waveFormat.nSamplesPerSec * waveFormat.nBlockAlign;
+				waveFormat.cbSize = 0;
+
+				m_nBlockFree = format.nBlocks;
+				if (waveOutOpen(&m_hwDevice, m_nDeviceID, &waveFormat, (DWORD_PTR)waveOutProcWrap, (DWORD_PTR)this, CALLBACK_FUNCTION) != S_OK)
+					return false;
+				m_bOpen = true;
+
+				// Link headers to block memory
+				m_WaveHeaders.assign(format.nBlocks, WAVEHDR{});
+				for (unsigned int n = 0; n < format.nBlocks; n++)
+				{
+					m_WaveHeaders[n].dwBufferLength = format.bytesPerBlock();
+					m_WaveHeaders[n].lpData = (LPSTR)pBlockMemory + n * format.bytesPerBlock();
+				}
+				return true;
+			}
+
+			void close() override
+			{
+				if (!m_bOpen)
+					return;
+				waveOutReset(m_hwDevice);
+				for (auto& header : m_WaveHeaders)
+					if (header.dwFlags & WHDR_PREPARED)
+						waveOutUnprepareHeader(m_hwDevice, &header, sizeof(WAVEHDR));
+				waveOutClose(m_hwDevice);
+				m_bOpen = false;
+			}
+
+			void waitForBlock(const unsigned int nBlock) override
+			{
+				if (m_nBlockFree == 0)
+				{
+					std::unique_lock<std::mutex> lm(m_muxBlockNotZero);
+					while (m_nBlockFree == 0) // sometimes, Windows signals incorrectly
+						m_cvBlockNotZero.wait(lm);
+				}
+				m_nBlockFree--;
+
+				if (m_WaveHeaders[nBlock].dwFlags & WHDR_PREPARED)
+					waveOutUnprepareHeader(m_hwDevice, &m_WaveHeaders[nBlock], sizeof(WAVEHDR));
+			}
+
+			bool submit(const unsigned int nBlock) override
+			{
+				waveOutPrepareHeader(m_hwDevice, &m_WaveHeaders[nBlock], sizeof(WAVEHDR));
+				return waveOutWrite(m_hwDevice, &m_WaveHeaders[nBlock], sizeof(WAVEHDR)) == MMSYSERR_NOERROR;
+			}
+
+		private:
+			// Handler for soundcard request for more data
+			static void CALLBACK waveOutProcWrap(HWAVEOUT /*hWaveOut*/, UINT uMsg, DWORD_PTR dwInstance, DWORD_PTR /*dwParam1*/, DWORD_PTR /*dwParam2*/)
+			{
+				if (uMsg != WOM_DONE) return;
+
+				auto pThis = (WinMMAudioBackend*)dwInstance;
+				pThis->m_nBlockFree++;
+				std::unique_lock<std::mutex> lm(pThis->m_muxBlockNotZero);
+				pThis->m_cvBlockNotZero.notify_one();
+			}
+
+			unsigned int m_nDeviceID;
+			HWAVEOUT m_hwDevice{};
+			bool m_bOpen = false;
+			std::vector<WAVEHDR> m_WaveHeaders;
+			std::atomic<unsigned int> m_nBlockFree = 0;
+			std::condition_variable m_cvBlockNotZero;
+			std::mutex m_muxBlockNotZero;
+		};
+#elif defined(SYNTH_ALSA)
+		// snd_pcm_writei() blocks until ALSA has room, so a block is free again
+		// as soon as it has been submitted
+		class AlsaAudioBackend : public AudioBackend
+		{
+		public:
+			explicit AlsaAudioBackend(const std::string& sDevice) : m_sDevice(sDevice) {}
+			~AlsaAudioBackend() override { close(); }
+
+			bool open(const AudioFormat& format, const void* pBlockMemory) override
+			{
+				snd_pcm_format_t nPcmFormat;
+				switch (format.nBitsPerSample)
+				{
+				case 8: nPcmFormat = SND_PCM_FORMAT_S8; break;
+				case 16: nPcmFormat = SND_PCM_FORMAT_S16; break;
+				case 24: nPcmFormat = SND_PCM_FORMAT_S24_3LE; break;
+				case 32: nPcmFormat = format.bFloat ? SND_PCM_FORMAT_FLOAT : SND_PCM_FORMAT_S32; break;
+				default: return false;
+				}
+
+				m_Format = format;
+				m_pBlockMemory = static_cast<const char*>(pBlockMemory);
+				if (snd_pcm_open(&m_pPcm, m_sDevice.c_str(), SND_PCM_STREAM_PLAYBACK, 0) < 0)
+				{
+					m_pPcm = nullptr;
+					return false;
+				}
+
+				// Ask for as much buffering as the blocks would give
+				const uint64_t nFrames = uint64_t(format.nBlocks) * format.nBlockSamples / format.nChannels;
+				const unsigned int nLatencyMicroseconds = static_cast<unsigned int>(nFrames * 1000000 / format.nSampleRate);
+				if (snd_pcm_set_params(m_pPcm, nPcmFormat, SND_PCM_ACCESS_RW_INTERLEAVED, format.nChannels, format.nSampleRate, 1, nLatencyMicroseconds) < 0)
+				{
+					close();
+					return false;
+				}
+				return true;
+			}
+
+			void close() override
+			{
+				if (m_pPcm == nullptr)
+					return;
+				snd_pcm_drain(m_pPcm);
+				snd_pcm_close(m_pPcm);
+				m_pPcm = nullptr;
+			}
+
+			void waitForBlock(const unsigned int /*nBlock*/) override {}
+
+			bool submit(const unsigned int nBlock) override
+			{
+				const unsigned int nFrameBytes = m_Format.nChannels * m_Format.nBitsPerSample / 8;
+				const char* pData = m_pBlockMemory + size_t(nBlock) * m_Format.bytesPerBlock();
+				snd_pcm_uframes_t nFrames = m_Format.nBlockSamples / m_Format.nChannels;
+				while (nFrames > 0)
+				{
+					const snd_pcm_sframes_t nWritten = snd_pcm_writei(m_pPcm, pData, nFrames);
+					if (nWritten == -EAGAIN)
+						continue;
+					if (nWritten < 0)
+					{
+						if (nWritten == -EPIPE)
+							++m_nUnderruns;
+						if (snd_pcm_recover(m_pPcm, static_cast<int>(nWritten), 1) < 0)
+							return false;
+						continue;
+					}
+					pData += nWritten * nFrameBytes;
+					nFrames -= static_cast<snd_pcm_uframes_t>(nWritten);
+				}
+				return true;
+			}
+
+			uint64_t underruns() const override { return m_nUnderruns; }
+
+		private:
+			std::string m_sDevice;
+			snd_pcm_t* m_pPcm = nullptr;
+			AudioFormat m_Format;
+			const char* m_pBlockMemory = nullptr;
+			std::atomic<uint64_t> m_nUnderruns = 0;
+		};
+#endif
+	}
+
+	bool NullAudioBackend::open(const AudioFormat& format, const void* /*pBlockMemory*/)
+	{
+		if (format.nSampleRate == 0 || format.nChannels == 0)
+			return false;
+		m_Format = format;
+		m_nSubmitted = 0;
+		m_nUnderruns = 0;
+		return true;
+	}
+
+	NullAudioBackend::Clock::time_point NullAudioBackend::deadline(const uint64_t nBlock) const
+	{
+		// Counted in whole frames from the start so that rounding never accumulates
+		const uint64_t nFrames = nBlock * (m_Format.nBlockSamples / m_Format.nChannels);
+		const auto nanoseconds = std::chrono::nanoseconds(nFrames * 1000000000 / m_Format.nSampleRate);
+		return m_Start + std::chrono::duration_cast<Clock::duration>(nanoseconds);
+	}
+
+	void NullAudioBackend::waitForBlock(const unsigned int /*nBlock*/)
+	{
+		// The next block reuses the memory of the one submitted nBlocks ago,
+		// which is free once that has finished playing
+		if (m_nSubmitted >= m_Format.nBlocks)
+			std::this_thread::sleep_until(deadline(m_nSubmitted - m_Format.nBlocks + 1));
+	}
+
+	bool NullAudioBackend::submit(const unsigned int /*nBlock*/)
+	{
+		const auto now = Clock::now();
+		if (m_nSubmitted == 0)
+			m_Start = now;
+		else if (now > deadline(m_nSubmitted))
+		{
+			// Too late to play on time, so like a sound card, restart from here
+			++m_nUnderruns;
+			m_Start += now - deadline(m_nSubmitted);
+		}
+		++m_nSubmitted;
+		return true;
+	}
+
+	FileAudioBackend::FileAudioBackend(const std::string& sFileName)
+		: m_sFileName(sFileName)
+	{
+	}
+
+	bool FileAudioBackend::open(const AudioFormat& format, const void* pBlockMemory)
+	{
+		m_Format = format;
+		m_pBlockMemory = static_cast<const char*>(pBlockMemory);
+		m_nDataBytes = 0;
+		m_bWav = m_sFileName.size() >= 4 && m_sFileName.compare(m_sFileName.size() - 4, 4, ".wav") == 0;
+
+		m_File.open(m_sFileName, std::ios::binary | std::ios::trunc);
+		if (!m_File)
+			return false;
+
+		// Sizes are filled in by close()
+		if (m_bWav)
+			writeWavHeader(0);
+		return m_File.good();
+	}
+
+	void FileAudioBackend::close()
+	{
+		if (!m_File.is_open())
+			return;
+		if (m_bWav)
+		{
+			// RIFF chunks are a whole number of 16 bit words, odd data gets a pad byte
+			if (m_nDataBytes % 2 != 0)
+				m_File.put(0);
+			m_File.seekp(0);
+			writeWavHeader(m_nDataBytes);
+		}
+		m_File.close();
+	}
+
+	bool FileAudioBackend::submit(const unsigned int nBlock)
+	{
+		const unsigned int nBytes = m_Format.bytesPerBlock();
+		return write(m_pBlockMemory + size_t(nBlock) * nBytes, nBytes);
+	}
+
+	bool FileAudioBackend::write(const void* pData, const size_t nBytes)
+	{
+		m_File.write(static_cast<const char*>(pData), static_cast<std::streamsize>(nBytes));
+		m_nDataBytes += nBytes;
+		return m_File.good();
+	}
+
+	void FileAudioBackend::writeWavHeader(const uint64_t nDataBytes)
+	{
+		// Samples wider than 16 bits, or more than two channels, need
+		// WAVE_FORMAT_EXTENSIBLE to say how they are laid out. Anything but
+		// plain PCM needs a fact chunk with the number of frames.
+		const bool bExtensible = m_Format.nBitsPerSample > 16 || m_Format.nChannels > 2;
+		const uint32_t nFormatTag = m_Format.bFloat ? 3 : 1;	// IEEE float or PCM
+		const uint32_t nFmtBytes = bExtensible ? 40 : 16;
+		const uint32_t nFactBytes = m_Format.bFloat ? 12 : 0;
+		const uint32_t nBlockAlign = m_Format.nChannels * m_Format.nBitsPerSample / 8;
+		const uint32_t nData = static_cast<uint32_t>(std::min<uint64_t>(nDataBytes, 0xffffffffu - 128));
+
+		m_File.write("RIFF", 4);
+		writeLE(m_File, 4 + (8 + nFmtBytes) + nFactBytes + 8 + nData + nData % 2, 4);
+		m_File.write("WAVEfmt ", 8);
+		writeLE(m_File, nFmtBytes, 4);
+		writeLE(m_File, bExtensible ? 0xfffe : nFormatTag, 2);
+		writeLE(m_File, m_Format.nChannels, 2);
+		writeLE(m_File, m_Format.nSampleRate, 4);
+		writeLE(m_File, m_Format.nSampleRate * nBlockAlign, 4);
+		writeLE(m_File, nBlockAlign, 2);
+		writeLE(m_File, m_Format.nBitsPerSample, 2);
+		if (bExtensible)
+		{
+			// Channels 0 and 1 are front left and right, a single channel is front centre
+			writeLE(m_File, 22, 2);
+			writeLE(m_File, m_Format.nBitsPerSample, 2);
+			writeLE(m_File, m_Format.nChannels == 1 ? 0x4 : 0x3, 4);
+			// The format tag within the KSDATAFORMAT_SUBTYPE GUID
+			writeLE(m_File, nFormatTag, 4);
+			m_File.write("\x00\x00\x10\x00\x80\x00\x00\xAA\x00\x38\x9B\x71", 12);
+		}
+		if (m_Format.bFloat)
+		{
+			m_File.write("fact", 4);
+			writeLE(m_File, 4, 4);
+			writeLE(m_File, nBlockAlign ? nData / nBlockAlign : 0, 4);
+		}
+		m_File.write("data", 4);
+		writeLE(m_File, nData, 4);
+	}
+
+	std::vector<std::string> audioDevices()
+	{
+		std::vector<std::string> sDevices;
+#if defined(_WIN32)
+		const UINT nDeviceCount = waveOutGetNumDevs();
+		WAVEOUTCAPSA woc;
+		for (UINT n = 0; n < nDeviceCount; n++)
+			if (waveOutGetDevCapsA(n, &woc, sizeof(WAVEOUTCAPSA)) == S_OK)
+				sDevices.push_back(woc.szPname);
+#elif defined(SYNTH_ALSA)
+		sDevices.push_back("default");
+		void** pHints = nullptr;
+		if (snd_device_name_hint(-1, "pcm", &pHints) == 0)
+		{
+			for (void** p = pHints; *p != nullptr; ++p)
+			{
+				char* pName = snd_device_name_get_hint(*p, "NAME");
+				char* pDirection = snd_device_name_get_hint(*p, "IOID");
+				// No IOID means the device does both input and output
+				if (pName != nullptr && (pDirection == nullptr || std::string(pDirection) == "Output") && std::string(pName) != "default")
+					sDevices.push_back(pName);
+				free(pName);
+				free(pDirection);
+			}
+			snd_device_name_free_hint(pHints);
+		}
+#endif
+		sDevices.push_back("null");
+		return sDevices;
+	}
+
+	std::unique_ptr<AudioBackend> makeAudioBackend(const std::string& sDevice)
+	{
+		if (sDevice == "null")
+			return std::make_unique<NullAudioBackend>();
+		if (sDevice.rfind("file:", 0) == 0)
+			return std::make_unique<FileAudioBackend>(sDevice.substr(5));
+
+#if defined(_WIN32)
+		const auto sDevices = audioDevices();
+		const auto d = std::find(sDevices.begin(), sDevices.end(), sDevice);
+		if (d != sDevices.end())
+			return std::make_unique<WinMMAudioBackend>(static_cast<unsigned int>(d - sDevices.begin()));
+		return nullptr;
+#elif defined(SYNTH_ALSA)
+		return std::make_unique<AlsaAudioBackend>(sDevice);
+#else
+		return nullptr;
+#endif
+	}
+}
@@ -0,0 +1,98 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <fstream>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace Synth
+{
+	struct AudioFormat
+	{
+		unsigned int nSampleRate = 44100;
+		unsigned int nChannels = 1;
+		unsigned int nBitsPerSample = 16;
+		bool bFloat = false;				// Samples are 32 bit floats rather than signed integers
+		unsigned int nBlocks = 8;
+		unsigned int nBlockSamples = 512;	// Samples per block, counting every channel
+
+		unsigned int bytesPerBlock() const { return nBlockSamples * nBitsPerSample / 8; }
+	};
+
+	// Where olcNoiseMaker sends its audio. The caller owns nBlocks blocks of
+	// interleaved samples, fills them in turn and hands each one over with
+	// submit(). A block must not be filled again until waitForBlock() says the
+	// backend has finished with it.
+	class AudioBackend
+	{
+	public:
+		virtual ~AudioBackend() = default;
+
+		// pBlockMemory holds format.nBlocks blocks and must outlive the backend
+		virtual bool open(const AudioFormat& format, const void* pBlockMemory) = 0;
+		virtual void close() = 0;
+
+		// Blocks until block nBlock can be filled
+		virtual void waitForBlock(const unsigned int nBlock) = 0;
+		virtual bool submit(const unsigned int nBlock) = 0;
+
+		// Number of blocks that were not ready when the output needed them
+		virtual uint64_t underruns() const { return 0; }
+	};
+
+	// Discards the audio but takes as long as a sound card would to play it,
+	// so rendering can be timed against real deadlines without any hardware.
+	class NullAudioBackend : public AudioBackend
+	{
+	public:
+		bool open(const AudioFormat& format, const void* pBlockMemory) override;
+		void close() override {}
+		void waitForBlock(const unsigned int nBlock) override;
+		bool submit(const unsigned int nBlock) override;
+		uint64_t underruns() const override { return m_nUnderruns; }
+
+	private:
+		using Clock = std::chrono::steady_clock;
+
+		Clock::time_point deadline(const uint64_t nBlock) const;
+
+		AudioFormat m_Format;
+		Clock::time_point m_Start;
+		uint64_t m_nSubmitted = 0;
+		std::atomic<uint64_t> m_nUnderruns = 0;
+	};
+
+	// Writes the audio to a file as fast as it is produced. A name ending in
+	// ".wav" gets a WAV header, anything else is raw little-endian samples.
+	class FileAudioBackend : public AudioBackend
+	{
+	public:
+		explicit FileAudioBackend(const std::string& sFileName);
+
+		bool open(const AudioFormat& format, const void* pBlockMemory) override;
+		void close() override;
+		void waitForBlock(const unsigned int /*nBlock*/) override {}
+		bool submit(const unsigned int nBlock) override;
+
+		// Appends samples that are not in a block
+		bool write(const void* pData, const size_t nBytes);
+
+	private:
+		void writeWavHeader(const uint64_t nDataBytes);
+
+		std::string m_sFileName;
+		std::ofstream m_File;
+		bool m_bWav = false;
+		AudioFormat m_Format;
+		const char* m_pBlockMemory = nullptr;
+		uint64_t m_nDataBytes = 0;
+	};
+
+	// Output device names: "null", "file:<path>", or one of the names returned
+	// by audioDevices() for the platform's sound system (winmm or ALSA).
+	std::vector<std::string> audioDevices();
+	std::unique_ptr<AudioBackend> makeAudioBackend(const std::string& sDevice);
+}
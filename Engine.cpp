@@ -0,0 +1,382 @@
+#include "Engine.h"
+
+#include <algorithm>
+#include <assert.h>
+
+namespace Synth
+{
+	Engine::Engine(const size_t nMaxVoices, const StealPolicy nStealPolicy, const unsigned int nRenderThreads)
+		: m_Voices(nMaxVoices + FadeVoices)
+		, m_NoteIndex(nMaxVoices + FadeVoices)
+		, m_RenderPool(nRenderThreads)
+		, m_vVoiceOutput((nMaxVoices + FadeVoices) * MaxBlockSamples)
+		, m_vVoiceFinished(nMaxVoices + FadeVoices)
+		, m_vBatches(nMaxVoices + FadeVoices)
+		, m_nMaxVoices(nMaxVoices)
+		, m_nStealPolicy(nStealPolicy)
+	{
+		m_vecPending.reserve(MaxPendingCommands);
+	}
+
+	bool Engine::post(const Command& cmd)
+	{
+		return m_Commands.push(cmd);
+	}
+
+	bool Engine::noteOn(Instrument* pInstrument, const int nNoteID, const FTYPE dVelocity, const int nPriority)
+	{
+		return post({ Command::NOTE_ON, pInstrument, nNoteID, dVelocity, nPriority });
+	}
+
+	bool Engine::noteTrigger(Instrument* pInstrument, const int nNoteID, const FTYPE dVelocity, const int nPriority, const uint64_t nSample)
+	{
+		return post({ Command::NOTE_TRIGGER, pInstrument, nNoteID, dVelocity, nPriority, nSample });
+	}
+
+	bool Engine::noteOff(Instrument* pInstrument, const int nNoteID)
+	{
+		return post({ Command::NOTE_OFF, pInstrument, nNoteID, 0.0 });
+	}
+
+	bool Engine::allNotesOff(Instrument* pInstrument)
+	{
+		return post({ Command::ALL_NOTES_OFF, pInstrument, 0, 0.0 });
+	}
+
+	bool Engine::setVolume(Instrument* pInstrument, const FTYPE dVolume)
+	{
+		return post({ Command::SET_VOLUME, pInstrument, 0, dVolume });
+	}
+
+	NoteInstrumentPtr* Engine::find(const Instrument* pInstrument, const int nNoteID)
+	{
+		const size_t nSlot = m_NoteIndex.find(pInstrument, nNoteID);
+		return (nSlot == NoteIndex::NoSlot) ? nullptr : &m_Voices[m_Voices.position(nSlot)];
+	}
+
+	size_t Engine::chooseVictim(const Command& cmd) const
+	{
+		const auto nPolicy = m_nStealPolicy.load(std::memory_order_relaxed);
+		const size_t nNone = m_Voices.size();
+		if (nPolicy == STEAL_NONE)
+			return nNone;
+
+		const auto loudness = [&](const NoteInstrumentPtr& v)
+		{
+			return v.m_pInstrument ? v.m_State.env.level() * v.m_Note.velocity : 0.0;
+		};
+
+		// Returns true if voice a should be stolen in preference to voice b
+		const auto better = [&](const NoteInstrumentPtr& a, const NoteInstrumentPtr& b)
+		{
+			switch (nPolicy)
+			{
+			case STEAL_QUIETEST:
+				return loudness(a) < loudness(b);
+			case STEAL_LOWEST_PRIORITY:
+				if (a.m_Note.priority != b.m_Note.priority)
+					return a.m_Note.priority < b.m_Note.priority;
+				return a.m_Note.on < b.m_Note.on;
+			default:
+				return a.m_Note.on < b.m_Note.on;
+			}
+		};
+
+		size_t nVictim = nNone;
+		for (size_t i = 0; i < m_Voices.size(); ++i)
+		{
+			const auto& v = m_Voices[i];
+			if (v.m_State.bStolen)
+				continue;
+			if (nPolicy == STEAL_SAME_NOTE && v.m_pInstrument == cmd.pInstrument && v.m_Note.id == cmd.nNoteID)
+				return i;
+			if (nVictim == nNone || better(v, m_Voices[nVictim]))
+				nVictim = i;
+		}
+
+		// Never steal from a more important note
+		if (nPolicy == STEAL_LOWEST_PRIORITY && nVictim != nNone && m_Voices[nVictim].m_Note.priority > cmd.nPriority)
+			return nNone;
+
+		return nVictim;
+	}
+
+	NoteInstrumentPtr* Engine::allocate(const Command& cmd)
+	{
+		if (m_Voices.size() - m_nFadingVoices < m_nMaxVoices)
+		{
+			// At most FadeVoices voices are ever fading, so there is always room
+			auto pVoice = m_Voices.allocate();
+			assert(pVoice);
+			return pVoice;
+		}
+
+		const size_t nVictim = chooseVictim(cmd);
+		if (nVictim == m_Voices.size())
+			return nullptr;
+		reportStolen(nVictim);
+
+		if (m_Voices.full())
+		{
+			// No room for it to fade out, so stop it now and reuse it
+			release(nVictim);
+			return m_Voices.allocate();
+		}
+
+		auto& victim = m_Voices[nVictim].m_State;
+		victim.bStolen = true;
+		victim.dFadeStep = 1.0 / (StealFadeTime * sampleRate());
+		++m_nFadingVoices;
+		m_NoteIndex.erase(m_Voices.slot(nVictim));
+		return m_Voices.allocate();
+	}
+
+	void Engine::reportStolen(const size_t nVoice)
+	{
+		// Nobody may be listening, so a full queue just drops the report
+		const auto& [n, c, s] = m_Voices[nVoice];
+		if (n.held())
+			m_Stolen.push({ Command::NOTE_ON, c, n.id, n.velocity, n.priority });
+	}
+
+	void Engine::release(const size_t nVoice)
+	{
+		if (m_Voices[nVoice].m_State.bStolen)
+			--m_nFadingVoices;
+		m_NoteIndex.erase(m_Voices.slot(nVoice));
+		m_Voices.release(nVoice);
+	}
+
+	void Engine::apply(const Command& cmd)
+	{
+		switch (cmd.type)
+		{
+		case Command::NOTE_ON:
+			if (auto pFound = find(cmd.pInstrument, cmd.nNoteID))
+			{
+				// Note has been pressed again during its release phase
+				if (!pFound->m_Note.held())
+				{
+					pFound->m_Note.on = m_nSampleClock;
+					pFound->m_Note.active = true;
+				}
+				break;
+			}
+			[[fallthrough]];
+
+		case Command::NOTE_TRIGGER:
+			if (auto pVoice = allocate(cmd))
+			{
+				pVoice->m_Note.id = cmd.nNoteID;
+				pVoice->m_Note.on = m_nSampleClock;
+				pVoice->m_Note.velocity = cmd.dValue;
+				pVoice->m_Note.priority = cmd.nPriority;
+				pVoice->m_Note.active = true;
+				pVoice->m_pInstrument = cmd.pInstrument;
+
+				// Balance law, so a note in the middle plays at full level on both sides
+				if (cmd.pInstrument)
+				{
+					const FTYPE dPan = std::clamp(cmd.pInstrument->dPan + cmd.pInstrument->dSpread * (cmd.nNoteID - BaseNoteID) / 12.0, -1.0, 1.0);
+					pVoice->m_State.dPanGain[0] = std::min(1.0 - dPan, 1.0);
+					pVoice->m_State.dPanGain[1] = std::min(1.0 + dPan, 1.0);
+				}
+
+				// New voices are always the last active one
+				m_NoteIndex.insert(cmd.pInstrument, cmd.nNoteID, m_Voices.slot(m_Voices.size() - 1));
+
+				// Voices are seeded in the order they start, so the same commands give the same noise
+				const uint64_t nSeed = m_nVoicesStarted++ * MaxVoiceOscillators;
+				const int nControlSamples = cmd.pInstrument ? cmd.pInstrument->nControlSamples : 1;
+				for (size_t i = 0; i < MaxVoiceOscillators; ++i)
+				{
+					pVoice->m_State.osc[i].noise.seed(nSeed + i);
+					pVoice->m_State.osc[i].nLFOInterval = nControlSamples;
+				}
+			}
+			break;
+
+		case Command::NOTE_OFF:
+			if (auto pFound = find(cmd.pInstrument, cmd.nNoteID))
+			{
+				if (pFound->m_Note.held())
+					pFound->m_Note.off = m_nSampleClock;
+			}
+			break;
+
+		case Command::ALL_NOTES_OFF:
+			for (size_t i = 0; i < m_Voices.size(); ++i)
+			{
+				auto& [n, c, s] = m_Voices[i];
+				if (c == cmd.pInstrument && n.held())
+					n.off = m_nSampleClock;
+			}
+			break;
+
+		case Command::SET_VOLUME:
+			if (cmd.pInstrument)
+				cmd.pInstrument->dVolume = cmd.dValue;
+			else
+				m_dMasterVolume = cmd.dValue;
+			break;
+		}
+	}
+
+	void Engine::schedule(const Command& cmd)
+	{
+		if (cmd.nSample <= m_nSampleClock)
+		{
+			apply(cmd);
+			return;
+		}
+		assert(m_vecPending.size() < MaxPendingCommands);
+
+		// Commands for the same sample stay in the order they were posted
+		auto pos = std::find_if(m_vecPending.begin(), m_vecPending.end(), [&](const Command& c) { return c.nSample <= cmd.nSample; });
+		m_vecPending.insert(pos, cmd);
+	}
+
+	void Engine::render(STYPE* pOutput, const unsigned int nFrames, const uint64_t nSample, const unsigned int nChannels)
+	{
+		m_nSampleClock = nSample;
+
+		// Render up to the next scheduled command, apply it, and carry on
+		unsigned int nDone = 0;
+		while (true)
+		{
+			while (!m_vecPending.empty() && m_vecPending.back().nSample <= m_nSampleClock)
+			{
+				apply(m_vecPending.back());
+				m_vecPending.pop_back();
+			}
+
+			// Commands are only taken off the queue while the schedule has room for
+			// them, so none is ever applied early. When it is full the queue fills
+			// behind it, and post() fails until enough commands have come due.
+			Command cmd;
+			while (m_vecPending.size() < MaxPendingCommands && m_Commands.pop(cmd))
+				schedule(cmd);
+
+			if (nDone == nFrames)
+				break;
+
+			unsigned int nCount = std::min<unsigned int>(nFrames - nDone, MaxBlockSamples);
+			if (!m_vecPending.empty())
+				nCount = static_cast<unsigned int>(std::min<uint64_t>(nCount, m_vecPending.back().nSample - m_nSampleClock));
+
+			renderVoices(pOutput + size_t(nDone) * nChannels, static_cast<int>(nCount), nChannels);
+			nDone += nCount;
+			m_nSampleClock += nCount;
+		}
+
+		m_nActiveVoices.store(m_Voices.size(), std::memory_order_relaxed);
+		m_nRenderedSamples.store(m_nSampleClock, std::memory_order_release);
+	}
+
+	void Engine::renderBatch(void* pEngine, const size_t nBatch)
+	{
+		auto& engine = *static_cast<Engine*>(pEngine);
+		auto& batch = engine.m_vBatches[nBatch];
+		const int nSamples = engine.m_nBlockSamples;
+
+		// Get samples for these notes by using the correct instrument and envelope
+		batch.pInstrument->renderVoices(engine.m_nSampleClock, batch.voices, nSamples);
+
+		for (size_t k = 0; k < batch.voices.nVoices; ++k)
+		{
+			auto& [n, c, s] = engine.m_Voices[batch.nVoice[k]];
+			STYPE* pVoice = batch.voices.pOutput[k];
+			bool bNoteFinished = batch.voices.bFinished[k];
+
+			const STYPE dGain = static_cast<STYPE>(n.velocity * engine.m_dMasterVolume);
+			if (!s.bStolen)
+			{
+				for (int j = 0; j < nSamples; ++j)
+					pVoice[j] *= dGain;
+			}
+			else
+			{
+				for (int j = 0; j < nSamples; ++j)
+				{
+					pVoice[j] = pVoice[j] * dGain * static_cast<STYPE>(s.dFadeGain);
+					s.dFadeGain = std::max(s.dFadeGain - s.dFadeStep, 0.0);
+				}
+				if (s.dFadeGain <= 0.0)
+					bNoteFinished = true;
+			}
+			engine.m_vVoiceFinished[batch.nVoice[k]] = bNoteFinished;
+		}
+	}
+
+	void Engine::renderVoices(STYPE* pOutput, const int nSamples, const unsigned int nChannels)
+	{
+		assert(nSamples <= MaxBlockSamples);
+
+		// Group the voices by instrument, so instruments can render several at once
+		m_nBatches = 0;
+		for (size_t i = 0; i < m_Voices.size(); ++i)
+		{
+			auto& voice = m_Voices[i];
+			STYPE* pVoice = &m_vVoiceOutput[i * MaxBlockSamples];
+			if (voice.m_pInstrument == nullptr)
+			{
+				std::fill(pVoice, pVoice + nSamples, STYPE(0));
+				m_vVoiceFinished[i] = true;
+				continue;
+			}
+
+			Batch* pBatch = nullptr;
+			for (size_t b = 0; b < m_nBatches && pBatch == nullptr; ++b)
+			{
+				if (m_vBatches[b].pInstrument == voice.m_pInstrument && m_vBatches[b].voices.nVoices < MaxBatchVoices)
+					pBatch = &m_vBatches[b];
+			}
+			if (pBatch == nullptr)
+			{
+				pBatch = &m_vBatches[m_nBatches++];
+				pBatch->pInstrument = voice.m_pInstrument;
+				pBatch->voices.nVoices = 0;
+			}
+
+			const size_t k = pBatch->voices.nVoices++;
+			pBatch->voices.pNote[k] = &voice.m_Note;
+			pBatch->voices.pState[k] = &voice.m_State;
+			pBatch->voices.pOutput[k] = pVoice;
+			pBatch->voices.bFinished[k] = false;
+			pBatch->nVoice[k] = i;
+		}
+
+		// Each batch renders into its voices' own buffers, on whichever thread gets to it
+		m_nBlockSamples = nSamples;
+		m_RenderPool.run(&Engine::renderBatch, this, m_nBatches);
+
+		// Mix together in voice order, so the sum does not depend on the threads
+		std::fill(pOutput, pOutput + size_t(nSamples) * nChannels, STYPE(0));
+		for (size_t i = 0; i < m_Voices.size(); ++i)
+		{
+			const STYPE* pVoice = &m_vVoiceOutput[i * MaxBlockSamples];
+			if (nChannels == 1)
+			{
+				for (int j = 0; j < nSamples; ++j)
+					pOutput[j] += pVoice[j];
+				continue;
+			}
+
+			const STYPE dLeft = static_cast<STYPE>(m_Voices[i].m_State.dPanGain[0]);
+			const STYPE dRight = static_cast<STYPE>(m_Voices[i].m_State.dPanGain[1]);
+			for (int j = 0; j < nSamples; ++j)
+			{
+				pOutput[j * nChannels] += pVoice[j] * dLeft;
+				pOutput[j * nChannels + 1] += pVoice[j] * dRight;
+			}
+		}
+
+		// Remove notes which are now finished. Going backwards, the last voice
+		// that moves into a freed position has already been dealt with.
+		for (size_t i = m_Voices.size(); i-- > 0;)
+		{
+			if (m_vVoiceFinished[i])
+				release(i);
+		}
+	}
+}
@@ -0,0 +1,141 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <vector>
+
+#include "NoteIndex.h"
+#include "RenderPool.h"
+#include "SpscQueue.h"
+#include "Synth.h"
+#include "VoicePool.h"
+
+namespace Synth
+{
+	// Message from the UI thread to the render thread
+	struct Command
+	{
+		enum Type
+		{
+			NOTE_ON			// Start a note, or retrigger it if it is already playing on this instrument
+			, NOTE_TRIGGER	// Start a note on a new voice, even if it is already playing
+			, NOTE_OFF		// Release a note
+			, ALL_NOTES_OFF	// Release every note on an instrument
+			, SET_VOLUME	// Set the volume of an instrument, or the master volume if there is no instrument
+		};
+
+		Type type = NOTE_ON;
+		Instrument* pInstrument = nullptr;
+		int nNoteID = 0;
+		FTYPE dValue = 0.0;	// Velocity for notes, volume for SET_VOLUME
+		int nPriority = 0;	// For notes, see Note::priority
+		uint64_t nSample = 0;	// Sample clock time to apply the command at, commands already due are applied at the start of the next block
+	};
+
+	// What to do with a new note when the polyphony limit has been reached
+	enum StealPolicy
+	{
+		STEAL_NONE				// Drop the new note
+		, STEAL_OLDEST			// Steal the voice that started first
+		, STEAL_QUIETEST		// Steal the voice with the lowest envelope amplitude times velocity
+		, STEAL_SAME_NOTE		// Steal a voice playing the same note on the same instrument, else the oldest
+		, STEAL_LOWEST_PRIORITY	// Steal the oldest of the lowest priority voices, or drop the new note if its priority is lower still
+	};
+
+	// Owns the playing voices. The voices are only ever touched by the render
+	// thread; other threads change them by posting commands, which are applied
+	// at the start of the next block.
+	class Engine
+	{
+	public:
+		static constexpr size_t DefaultMaxVoices = 64;
+
+		// Stolen voices fade out over this time, in seconds, rather than stopping with a click
+		static constexpr FTYPE StealFadeTime = 0.005;
+		// Extra voices kept for stolen voices to fade out in
+		static constexpr size_t FadeVoices = 16;
+
+		// All voices are allocated here, the render thread never allocates.
+		// At most nMaxVoices notes play at once, plus up to FadeVoices that are fading out.
+		// The voices of each block are shared out over nRenderThreads threads, counting the
+		// render thread. The output is the same whatever the number of threads.
+		explicit Engine(const size_t nMaxVoices = DefaultMaxVoices, const StealPolicy nStealPolicy = STEAL_OLDEST, const unsigned int nRenderThreads = 1);
+
+		// May be called from any thread, takes effect from the next note
+		void setStealPolicy(const StealPolicy nStealPolicy) { m_nStealPolicy = nStealPolicy; }
+
+		// Called from the UI thread. Each returns false if the command queue is
+		// full, which also happens once MaxPendingCommands future commands are
+		// waiting to be applied; render some more and try again.
+		bool post(const Command& cmd);
+		bool noteOn(Instrument* pInstrument, const int nNoteID, const FTYPE dVelocity = 1.0, const int nPriority = 0);
+		bool noteTrigger(Instrument* pInstrument, const int nNoteID, const FTYPE dVelocity = 1.0, const int nPriority = 0, const uint64_t nSample = 0);
+		bool noteOff(Instrument* pInstrument, const int nNoteID);
+		bool allNotesOff(Instrument* pInstrument);
+		bool setVolume(Instrument* pInstrument, const FTYPE dVolume);
+
+		// Called from the UI thread. Gets the next note that was still held when
+		// its voice was stolen, as the NOTE_ON that would start it again, so
+		// whoever is holding it can. Returns false if there are none.
+		bool pollStolen(Command& cmd) { return m_Stolen.pop(cmd); }
+
+		// Number of voices playing at the end of the last block
+		size_t activeVoices() const { return m_nActiveVoices.load(std::memory_order_relaxed); }
+
+		// Sample clock time of the first sample of the next block
+		uint64_t currentSample() const { return m_nRenderedSamples.load(std::memory_order_acquire); }
+
+		// Called from the render thread. Fills pOutput with nFrames frames of
+		// nChannels interleaved amplitudes (-1.0 to +1.0), the first at sample
+		// clock time nSample. Each voice is rendered once whatever the number
+		// of channels. Channels 0 and 1 are left and right, panned by each
+		// voice's Instrument::dPan and dSpread; any more are silent. A single
+		// channel is mono and ignores panning.
+		// Commands take effect at the exact sample they are scheduled for.
+		// With nFrames 0 it only applies the commands that are due and moves
+		// queued ones onto the schedule, as far as it has room.
+		void render(STYPE* pOutput, const unsigned int nFrames, const uint64_t nSample, const unsigned int nChannels = 1);
+
+		static constexpr size_t MaxPendingCommands = 1024;
+
+	private:
+
+		void schedule(const Command& cmd);
+		void renderVoices(STYPE* pOutput, const int nSamples, const unsigned int nChannels);
+		static void renderBatch(void* pEngine, const size_t nBatch);
+		void apply(const Command& cmd);
+		NoteInstrumentPtr* find(const Instrument* pInstrument, const int nNoteID);
+		NoteInstrumentPtr* allocate(const Command& cmd);
+		void release(const size_t nVoice);
+		void reportStolen(const size_t nVoice);
+		size_t chooseVictim(const Command& cmd) const;
+
+		SpscQueue<Command, 1024> m_Commands;
+		SpscQueue<Command, 64> m_Stolen;	// Held notes whose voices were stolen, render thread to UI thread
+		std::vector<Command> m_vecPending;	// Render thread only, latest first so the next one is at the back
+		VoicePool m_Voices;
+		NoteIndex m_NoteIndex;		// Voices that NOTE_ON and NOTE_OFF can find, stolen voices are left out
+		RenderPool m_RenderPool;
+		std::vector<STYPE> m_vVoiceOutput;		// MaxBlockSamples for each voice, mixed in voice order
+		std::vector<uint8_t> m_vVoiceFinished;
+		int m_nBlockSamples = 0;				// Length of the block being rendered, for renderBatch()
+
+		// Voices of the same instrument, rendered together by one thread
+		struct Batch
+		{
+			Instrument* pInstrument = nullptr;
+			VoiceBatch voices;
+			size_t nVoice[MaxBatchVoices] = {};	// Where each voice is in m_Voices
+		};
+		std::vector<Batch> m_vBatches;			// Room for a batch per voice
+		size_t m_nBatches = 0;
+		size_t m_nMaxVoices;
+		size_t m_nFadingVoices = 0;
+		std::atomic<StealPolicy> m_nStealPolicy;
+		FTYPE m_dMasterVolume = 0.2;
+		uint64_t m_nSampleClock = 0;	// Time of the next sample to render
+		uint64_t m_nVoicesStarted = 0;
+		std::atomic<size_t> m_nActiveVoices = 0;
+		std::atomic<uint64_t> m_nRenderedSamples = 0;
+	};
+}
@@ -0,0 +1,730 @@
+#include "Kernels.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <type_traits>
+
+#if defined(_M_X64) || defined(__x86_64__)
+#define SYNTH_X86_KERNELS
+#include <immintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+#endif
+
+// MSVC lets any function use any instruction set; gcc and clang need to be told.
+// Flatten pulls the vector wrappers into the kernels that use them.
+#if defined(SYNTH_X86_KERNELS) && defined(__GNUC__)
+#define SYNTH_TARGET_AVX2 __attribute__((target("avx2,fma")))
+#define SYNTH_TARGET_SSE41 __attribute__((target("sse4.1")))
+#define SYNTH_FLATTEN __attribute__((flatten))
+// The wrappers only ever run inlined into a kernel with the right target, so
+// the vector ABI of their own signatures does not matter
+#pragma GCC diagnostic ignored "-Wpsabi"
+#else
+#define SYNTH_TARGET_AVX2
+#define SYNTH_TARGET_SSE41
+#define SYNTH_FLATTEN
+#endif
+
+namespace Synth
+{
+	namespace
+	{
+		// sin(2 pi r) ~= r * P(r * r) for |r| <= 0.25, minimax fit, see
+		// Kernels.h for its error
+		constexpr double SinC0 = 6.2831853064874021;
+		constexpr double SinC1 = -41.341701929736779;
+		constexpr double SinC2 = 81.605209427731538;
+		constexpr double SinC3 = -76.703667702384919;
+		constexpr double SinC4 = 41.999987793325417;
+		constexpr double SinC5 = -14.337012735486891;
+
+		template <typename T>
+		inline T sineCycles(const T dPhase)
+		{
+			// Into [-0.5, 0.5], then fold the outer quarters back using sin(pi - x) = sin(x)
+			T r = dPhase - std::nearbyint(dPhase);
+			if (r > T(0.25))
+				r = T(0.5) - r;
+			else if (r < T(-0.25))
+				r = T(-0.5) - r;
+			const T z = r * r;
+			return r * (T(SinC0) + z * (T(SinC1) + z * (T(SinC2) + z * (T(SinC3) + z * (T(SinC4) + z * T(SinC5))))));
+		}
+
+		void sineScalar(STYPE* pOutput, const STYPE* pPhase, const int nSamples, const STYPE dAmp)
+		{
+			for (int n = 0; n < nSamples; ++n)
+				pOutput[n] += dAmp * sineCycles(pPhase[n]);
+		}
+
+		void squareScalar(STYPE* pOutput, const STYPE* pPhase, const int nSamples, const STYPE dAmp)
+		{
+			for (int n = 0; n < nSamples; ++n)
+				pOutput[n] += pPhase[n] < STYPE(0.5) ? dAmp : -dAmp;
+		}
+
+		void triangleScalar(STYPE* pOutput, const STYPE* pPhase, const int nSamples, const STYPE dAmp)
+		{
+			for (int n = 0; n < nSamples; ++n)
+			{
+				STYPE dShifted = pPhase[n] - STYPE(0.25);
+				dShifted -= std::floor(dShifted);
+				pOutput[n] += dAmp * (STYPE(4.0) * std::fabs(dShifted - STYPE(0.5)) - STYPE(1.0));
+			}
+		}
+
+		void sawScalar(STYPE* pOutput, const STYPE* pPhase, const int nSamples, const STYPE dAmp)
+		{
+			for (int n = 0; n < nSamples; ++n)
+				pOutput[n] += dAmp * (STYPE(2.0) * pPhase[n] - STYPE(1.0));
+		}
+
+		void advanceScalar(STYPE* pPhase, const FTYPE* pStart, const FTYPE* pInc, FTYPE* pEnd, const int nLanes, const int nSamples)
+		{
+			for (int v = 0; v < nLanes; ++v)
+			{
+				FTYPE dNext = pStart[v];
+				for (int n = 0; n < nSamples; ++n)
+				{
+					pPhase[n * nLanes + v] = static_cast<STYPE>(dNext);
+					dNext += pInc[v];
+					dNext -= (dNext >= 1.0) ? 1.0 : 0.0;
+				}
+				pEnd[v] = dNext;
+			}
+		}
+
+		void wrapScalar(STYPE* pPhase, const STYPE* pOffset, const int nSamples)
+		{
+			for (int n = 0; n < nSamples; ++n)
+			{
+				pPhase[n] += pOffset[n];
+				pPhase[n] -= std::floor(pPhase[n]);
+			}
+		}
+
+		const WaveKernels ScalarKernels = { "scalar", sineScalar, squareScalar, triangleScalar, sawScalar, advanceScalar, wrapScalar };
+
+		// softClip() is linear up to SoftKnee and reaches full scale at 2 - SoftKnee
+		constexpr double SoftKnee = 0.5;
+		constexpr double SoftBend = -0.25 / (1.0 - SoftKnee);
+
+		void hardClipScalar(STYPE* pSamples, const int nSamples)
+		{
+			for (int n = 0; n < nSamples; ++n)
+				pSamples[n] = std::clamp(pSamples[n], STYPE(-1.0), STYPE(1.0));
+		}
+
+		void softClipScalar(STYPE* pSamples, const int nSamples)
+		{
+			for (int n = 0; n < nSamples; ++n)
+			{
+				const STYPE dAbs = std::fabs(pSamples[n]);
+				const STYPE dOver = std::clamp(dAbs - STYPE(SoftKnee), STYPE(0), STYPE(2.0 * (1.0 - SoftKnee)));
+				pSamples[n] = std::copysign(std::min(dAbs, STYPE(SoftKnee)) + (dOver * dOver * STYPE(SoftBend) + dOver), pSamples[n]);
+			}
+		}
+
+		// Round to nearest, like the SIMD conversions in the default rounding mode
+		int32_t toInt(const STYPE dSample, const FTYPE dFullScale)
+		{
+			const STYPE dScaled = std::clamp(dSample * static_cast<STYPE>(dFullScale), static_cast<STYPE>(-dFullScale - 1.0), static_cast<STYPE>(dFullScale));
+			return static_cast<int32_t>(std::lrint(dScaled));
+		}
+
+		void toInt16Scalar(int16_t* pOutput, const STYPE* pInput, const int nSamples)
+		{
+			for (int n = 0; n < nSamples; ++n)
+				pOutput[n] = static_cast<int16_t>(toInt(pInput[n], Int16FullScale));
+		}
+
+		void toInt24Scalar(uint8_t* pOutput, const STYPE* pInput, const int nSamples)
+		{
+			for (int n = 0; n < nSamples; ++n)
+			{
+				const int32_t nSample = toInt(pInput[n], Int24FullScale);
+				pOutput[3 * n] = static_cast<uint8_t>(nSample);
+				pOutput[3 * n + 1] = static_cast<uint8_t>(nSample >> 8);
+				pOutput[3 * n + 2] = static_cast<uint8_t>(nSample >> 16);
+			}
+		}
+
+		void toFloat32Scalar(float* pOutput, const STYPE* pInput, const int nSamples)
+		{
+			for (int n = 0; n < nSamples; ++n)
+				pOutput[n] = static_cast<float>(pInput[n]);
+		}
+
+		const OutputKernels ScalarOutputKernels = { "scalar", hardClipScalar, softClipScalar, toInt16Scalar, toInt24Scalar, toFloat32Scalar };
+
+#ifdef SYNTH_X86_KERNELS
+		//////////////////////////////////////////////////////////////////////////
+		// Each kernel is written once against a thin wrapper over the intrinsics
+		// for one instruction set and sample type. Width is the number of
+		// samples in a register. mulAdd(a, b, c) is a * b + c, and select(a, b, m)
+		// takes b where m is set. The toInt conversions round to nearest.
+
+		// Saturates the low nLanes 32 bit integers of lo then hi to 16 bits
+		template <int nLanes>
+		SYNTH_TARGET_SSE41 inline void storeInt16(int16_t* p, const __m128i lo, const __m128i hi)
+		{
+			int16_t nSamples[8];
+			_mm_storeu_si128(reinterpret_cast<__m128i*>(nSamples), _mm_packs_epi32(lo, hi));
+			memcpy(p, nSamples, sizeof(int16_t) * nLanes);
+		}
+
+		// Packs the low 3 bytes of each of the low nLanes 32 bit integers
+		template <int nLanes>
+		SYNTH_TARGET_SSE41 inline void storeInt24(uint8_t* p, const __m128i a)
+		{
+			uint8_t nBytes[16];
+			const __m128i vPack = _mm_setr_epi8(0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1);
+			_mm_storeu_si128(reinterpret_cast<__m128i*>(nBytes), _mm_shuffle_epi8(a, vPack));
+			memcpy(p, nBytes, 3 * nLanes);
+		}
+
+		template <typename T> struct AVX2;
+
+		template <> struct AVX2<double>
+		{
+			using V = __m256d;
+			static constexpr int Width = 4;
+			SYNTH_TARGET_AVX2 static V set(const double d) { return _mm256_set1_pd(d); }
+			SYNTH_TARGET_AVX2 static V load(const double* p) { return _mm256_loadu_pd(p); }
+			SYNTH_TARGET_AVX2 static void store(double* p, const V a) { _mm256_storeu_pd(p, a); }
+			SYNTH_TARGET_AVX2 static V add(const V a, const V b) { return _mm256_add_pd(a, b); }
+			SYNTH_TARGET_AVX2 static V sub(const V a, const V b) { return _mm256_sub_pd(a, b); }
+			SYNTH_TARGET_AVX2 static V mul(const V a, const V b) { return _mm256_mul_pd(a, b); }
+			SYNTH_TARGET_AVX2 static V mulAdd(const V a, const V b, const V c) { return _mm256_fmadd_pd(a, b, c); }
+			SYNTH_TARGET_AVX2 static V mulSub(const V a, const V b, const V c) { return _mm256_fmsub_pd(a, b, c); }
+			SYNTH_TARGET_AVX2 static V nearest(const V a) { return _mm256_round_pd(a, _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC); }
+			SYNTH_TARGET_AVX2 static V floor(const V a) { return _mm256_floor_pd(a); }
+			SYNTH_TARGET_AVX2 static V andNot(const V a, const V b) { return _mm256_andnot_pd(a, b); }
+			SYNTH_TARGET_AVX2 static V bitAnd(const V a, const V b) { return _mm256_and_pd(a, b); }
+			SYNTH_TARGET_AVX2 static V bitOr(const V a, const V b) { return _mm256_or_pd(a, b); }
+			SYNTH_TARGET_AVX2 static V select(const V a, const V b, const V m) { return _mm256_blendv_pd(a, b, m); }
+			SYNTH_TARGET_AVX2 static V greater(const V a, const V b) { return _mm256_cmp_pd(a, b, _CMP_GT_OQ); }
+			SYNTH_TARGET_AVX2 static V less(const V a, const V b) { return _mm256_cmp_pd(a, b, _CMP_LT_OQ); }
+			SYNTH_TARGET_AVX2 static V min(const V a, const V b) { return _mm256_min_pd(a, b); }
+			SYNTH_TARGET_AVX2 static V max(const V a, const V b) { return _mm256_max_pd(a, b); }
+			SYNTH_TARGET_AVX2 static void toInt16(int16_t* p, const V a) { const __m128i i = _mm256_cvtpd_epi32(a); storeInt16<4>(p, i, i); }
+			SYNTH_TARGET_AVX2 static void toInt24(uint8_t* p, const V a) { storeInt24<4>(p, _mm256_cvtpd_epi32(a)); }
+			SYNTH_TARGET_AVX2 static void toFloat32(float* p, const V a) { _mm_storeu_ps(p, _mm256_cvtpd_ps(a)); }
+		};
+
+		template <> struct AVX2<float>
+		{
+			using V = __m256;
+			static constexpr int Width = 8;
+			SYNTH_TARGET_AVX2 static V set(const float d) { return _mm256_set1_ps(d); }
+			SYNTH_TARGET_AVX2 static V load(const float* p) { return _mm256_loadu_ps(p); }
+			SYNTH_TARGET_AVX2 static void store(float* p, const V a) { _mm256_storeu_ps(p, a); }
+			SYNTH_TARGET_AVX2 static V add(const V a, const V b) { return _mm256_add_ps(a, b); }
+			SYNTH_TARGET_AVX2 static V sub(const V a, const V b) { return _mm256_sub_ps(a, b); }
+			SYNTH_TARGET_AVX2 static V mul(const V a, const V b) { return _mm256_mul_ps(a, b); }
+			SYNTH_TARGET_AVX2 static V mulAdd(const V a, const V b, const V c) { return _mm256_fmadd_ps(a, b, c); }
+			SYNTH_TARGET_AVX2 static V mulSub(const V a, const V b, const V c) { return _mm256_fmsub_ps(a, b, c); }
+			SYNTH_TARGET_AVX2 static V nearest(const V a) { return _mm256_round_ps(a, _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC); }
+			SYNTH_TARGET_AVX2 static V floor(const V a) { return _mm256_floor_ps(a); }
+			SYNTH_TARGET_AVX2 static V andNot(const V a, const V b) { return _mm256_andnot_ps(a, b); }
+			SYNTH_TARGET_AVX2 static V bitAnd(const V a, const V b) { return _mm256_and_ps(a, b); }
+			SYNTH_TARGET_AVX2 static V bitOr(const V a, const V b) { return _mm256_or_ps(a, b); }
+			SYNTH_TARGET_AVX2 static V select(const V a, const V b, const V m) { return _mm256_blendv_ps(a, b, m); }
+			SYNTH_TARGET_AVX2 static V greater(const V a, const V b) { return _mm256_cmp_ps(a, b, _CMP_GT_OQ); }
+			SYNTH_TARGET_AVX2 static V less(const V a, const V b) { return _mm256_cmp_ps(a, b, _CMP_LT_OQ); }
+			SYNTH_TARGET_AVX2 static V min(const V a, const V b) { return _mm256_min_ps(a, b); }
+			SYNTH_TARGET_AVX2 static V max(const V a, const V b) { return _mm256_max_ps(a, b); }
+			SYNTH_TARGET_AVX2 static void toInt16(int16_t* p, const V a)
+			{
+				const __m256i i = _mm256_cvtps_epi32(a);
+				storeInt16<8>(p, _mm256_castsi256_si128(i), _mm256_extracti128_si256(i, 1));
+			}
+			SYNTH_TARGET_AVX2 static void toInt24(uint8_t* p, const V a)
+			{
+				const __m256i i = _mm256_cvtps_epi32(a);
+				storeInt24<4>(p, _mm256_castsi256_si128(i));
+				storeInt24<4>(p + 12, _mm256_extracti128_si256(i, 1));
+			}
+			SYNTH_TARGET_AVX2 static void toFloat32(float* p, const V a) { _mm256_storeu_ps(p, a); }
+		};
+
+		// SSE4.1 has no fused multiply-add
+		template <typename T> struct SSE41;
+
+		template <> struct SSE41<double>
+		{
+			using V = __m128d;
+			static constexpr int Width = 2;
+			SYNTH_TARGET_SSE41 static V set(const double d) { return _mm_set1_pd(d); }
+			SYNTH_TARGET_SSE41 static V load(const double* p) { return _mm_loadu_pd(p); }
+			SYNTH_TARGET_SSE41 static void store(double* p, const V a) { _mm_storeu_pd(p, a); }
+			SYNTH_TARGET_SSE41 static V add(const V a, const V b) { return _mm_add_pd(a, b); }
+			SYNTH_TARGET_SSE41 static V sub(const V a, const V b) { return _mm_sub_pd(a, b); }
+			SYNTH_TARGET_SSE41 static V mul(const V a, const V b) { return _mm_mul_pd(a, b); }
+			SYNTH_TARGET_SSE41 static V mulAdd(const V a, const V b, const V c) { return _mm_add_pd(_mm_mul_pd(a, b), c); }
+			SYNTH_TARGET_SSE41 static V mulSub(const V a, const V b, const V c) { return _mm_sub_pd(_mm_mul_pd(a, b), c); }
+			SYNTH_TARGET_SSE41 static V nearest(const V a) { return _mm_round_pd(a, _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC); }
+			SYNTH_TARGET_SSE41 static V floor(const V a) { return _mm_floor_pd(a); }
+			SYNTH_TARGET_SSE41 static V andNot(const V a, const V b) { return _mm_andnot_pd(a, b); }
+			SYNTH_TARGET_SSE41 static V bitAnd(const V a, const V b) { return _mm_and_pd(a, b); }
+			SYNTH_TARGET_SSE41 static V bitOr(const V a, const V b) { return _mm_or_pd(a, b); }
+			SYNTH_TARGET_SSE41 static V select(const V a, const V b, const V m) { return _mm_blendv_pd(a, b, m); }
+			SYNTH_TARGET_SSE41 static V greater(const V a, const V b) { return _mm_cmpgt_pd(a, b); }
+			SYNTH_TARGET_SSE41 static V less(const V a, const V b) { return _mm_cmplt_pd(a, b); }
+			SYNTH_TARGET_SSE41 static V min(const V a, const V b) { return _mm_min_pd(a, b); }
+			SYNTH_TARGET_SSE41 static V max(const V a, const V b) { return _mm_max_pd(a, b); }
+			SYNTH_TARGET_SSE41 static void toInt16(int16_t* p, const V a) { const __m128i i = _mm_cvtpd_epi32(a); storeInt16<2>(p, i, i); }
+			SYNTH_TARGET_SSE41 static void toInt24(uint8_t* p, const V a) { storeInt24<2>(p, _mm_cvtpd_epi32(a)); }
+			SYNTH_TARGET_SSE41 static void toFloat32(float* p, const V a) { _mm_storel_pi(reinterpret_cast<__m64*>(p), _mm_cvtpd_ps(a)); }
+		};
+
+		template <> struct SSE41<float>
+		{
+			using V = __m128;
+			static constexpr int Width = 4;
+			SYNTH_TARGET_SSE41 static V set(const float d) { return _mm_set1_ps(d); }
+			SYNTH_TARGET_SSE41 static V load(const float* p) { return _mm_loadu_ps(p); }
+			SYNTH_TARGET_SSE41 static void store(float* p, const V a) { _mm_storeu_ps(p, a); }
+			SYNTH_TARGET_SSE41 static V add(const V a, const V b) { return _mm_add_ps(a, b); }
+			SYNTH_TARGET_SSE41 static V sub(const V a, const V b) { return _mm_sub_ps(a, b); }
+			SYNTH_TARGET_SSE41 static V mul(const V a, const V b) { return _mm_mul_ps(a, b); }
+			SYNTH_TARGET_SSE41 static V mulAdd(const V a, const V b, const V c) { return _mm_add_ps(_mm_mul_ps(a, b), c); }
+			SYNTH_TARGET_SSE41 static V mulSub(const V a, const V b, const V c) { return _mm_sub_ps(_mm_mul_ps(a, b), c); }
+			SYNTH_TARGET_SSE41 static V nearest(const V a) { return _mm_round_ps(a, _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC); }
+			SYNTH_TARGET_SSE41 static V floor(const V a) { return _mm_floor_ps(a); }
+			SYNTH_TARGET_SSE41 static V andNot(const V a, const V b) { return _mm_andnot_ps(a, b); }
+			SYNTH_TARGET_SSE41 static V bitAnd(const V a, const V b) { return _mm_and_ps(a, b); }
+			SYNTH_TARGET_SSE41 static V bitOr(const V a, const V b) { return _mm_or_ps(a, b); }
+			SYNTH_TARGET_SSE41 static V select(const V a, const V b, const V m) { return _mm_blendv_ps(a, b, m); }
+			SYNTH_TARGET_SSE41 static V greater(const V a, const V b) { return _mm_cmpgt_ps(a, b); }
+			SYNTH_TARGET_SSE41 static V less(const V a, const V b) { return _mm_cmplt_ps(a, b); }
+			SYNTH_TARGET_SSE41 static V min(const V a, const V b) { return _mm_min_ps(a, b); }
+			SYNTH_TARGET_SSE41 static V max(const V a, const V b) { return _mm_max_ps(a, b); }
+			SYNTH_TARGET_SSE41 static void toInt16(int16_t* p, const V a) { const __m128i i = _mm_cvtps_epi32(a); storeInt16<4>(p, i, i); }
+			SYNTH_TARGET_SSE41 static void toInt24(uint8_t* p, const V a) { storeInt24<4>(p, _mm_cvtps_epi32(a)); }
+			SYNTH_TARGET_SSE41 static void toFloat32(float* p, const V a) { _mm_storeu_ps(p, a); }
+		};
+
+		template <typename S>
+		inline void sineSimd(STYPE* pOutput, const STYPE* pPhase, const int nSamples, const STYPE dAmp)
+		{
+			using V = typename S::V;
+			const V vAmp = S::set(dAmp);
+			const V vQuarter = S::set(STYPE(0.25));
+			const V vHalf = S::set(STYPE(0.5));
+			const V vSign = S::set(STYPE(-0.0));
+			int n = 0;
+			for (; n + S::Width <= nSamples; n += S::Width)
+			{
+				const V vPhase = S::load(pPhase + n);
+				V r = S::sub(vPhase, S::nearest(vPhase));
+				const V vAbs = S::andNot(vSign, r);
+				const V vFolded = S::sub(S::bitOr(vHalf, S::bitAnd(vSign, r)), r);
+				r = S::select(r, vFolded, S::greater(vAbs, vQuarter));
+
+				const V z = S::mul(r, r);
+				V p = S::mulAdd(z, S::set(STYPE(SinC5)), S::set(STYPE(SinC4)));
+				p = S::mulAdd(z, p, S::set(STYPE(SinC3)));
+				p = S::mulAdd(z, p, S::set(STYPE(SinC2)));
+				p = S::mulAdd(z, p, S::set(STYPE(SinC1)));
+				p = S::mulAdd(z, p, S::set(STYPE(SinC0)));
+				const V vSine = S::mul(r, p);
+
+				S::store(pOutput + n, S::mulAdd(vAmp, vSine, S::load(pOutput + n)));
+			}
+			sineScalar(pOutput + n, pPhase + n, nSamples - n, dAmp);
+		}
+
+		template <typename S>
+		inline void squareSimd(STYPE* pOutput, const STYPE* pPhase, const int nSamples, const STYPE dAmp)
+		{
+			using V = typename S::V;
+			const V vAmp = S::set(dAmp);
+			const V vMinusAmp = S::set(-dAmp);
+			const V vHalf = S::set(STYPE(0.5));
+			int n = 0;
+			for (; n + S::Width <= nSamples; n += S::Width)
+			{
+				const V vLow = S::less(S::load(pPhase + n), vHalf);
+				const V vSquare = S::select(vMinusAmp, vAmp, vLow);
+				S::store(pOutput + n, S::add(S::load(pOutput + n), vSquare));
+			}
+			squareScalar(pOutput + n, pPhase + n, nSamples - n, dAmp);
+		}
+
+		template <typename S>
+		inline void triangleSimd(STYPE* pOutput, const STYPE* pPhase, const int nSamples, const STYPE dAmp)
+		{
+			using V = typename S::V;
+			const V vAmp = S::set(dAmp);
+			const V vQuarter = S::set(STYPE(0.25));
+			const V vHalf = S::set(STYPE(0.5));
+			const V vFour = S::set(STYPE(4.0));
+			const V vOne = S::set(STYPE(1.0));
+			const V vSign = S::set(STYPE(-0.0));
+			int n = 0;
+			for (; n + S::Width <= nSamples; n += S::Width)
+			{
+				V vShifted = S::sub(S::load(pPhase + n), vQuarter);
+				vShifted = S::sub(vShifted, S::floor(vShifted));
+				const V vAbs = S::andNot(vSign, S::sub(vShifted, vHalf));
+				const V vTriangle = S::mulSub(vFour, vAbs, vOne);
+				S::store(pOutput + n, S::mulAdd(vAmp, vTriangle, S::load(pOutput + n)));
+			}
+			triangleScalar(pOutput + n, pPhase + n, nSamples - n, dAmp);
+		}
+
+		template <typename S>
+		inline void sawSimd(STYPE* pOutput, const STYPE* pPhase, const int nSamples, const STYPE dAmp)
+		{
+			using V = typename S::V;
+			const V vAmp = S::set(dAmp);
+			const V vTwo = S::set(STYPE(2.0));
+			const V vOne = S::set(STYPE(1.0));
+			int n = 0;
+			for (; n + S::Width <= nSamples; n += S::Width)
+			{
+				const V vSaw = S::mulSub(vTwo, S::load(pPhase + n), vOne);
+				S::store(pOutput + n, S::mulAdd(vAmp, vSaw, S::load(pOutput + n)));
+			}
+			sawScalar(pOutput + n, pPhase + n, nSamples - n, dAmp);
+		}
+
+		// S works on FTYPE, as the phases are summed in it. Each group of
+		// S::Width lanes is one register, so the lanes advance together. When
+		// the lanes do not fill the last group it overlaps the one before,
+		// which only writes the same phases twice.
+		template <typename S>
+		inline void advanceSimd(STYPE* pPhase, const FTYPE* pStart, const FTYPE* pInc, FTYPE* pEnd, const int nLanes, const int nSamples)
+		{
+			if (nLanes < S::Width)
+				return advanceScalar(pPhase, pStart, pInc, pEnd, nLanes, nSamples);
+
+			using V = typename S::V;
+			const V vOne = S::set(1.0);
+			const V vZero = S::set(0.0);
+			for (int nGroup = 0; nGroup < nLanes; nGroup += S::Width)
+			{
+				const int v = std::min(nGroup, nLanes - S::Width);
+				const V vInc = S::load(pInc + v);
+				V vNext = S::load(pStart + v);
+				for (int n = 0; n < nSamples; ++n)
+				{
+					if constexpr (std::is_same_v<STYPE, FTYPE>)
+						S::store(pPhase + n * nLanes + v, vNext);
+					else
+						S::toFloat32(pPhase + n * nLanes + v, vNext);
+					vNext = S::add(vNext, vInc);
+					vNext = S::sub(vNext, S::select(vOne, vZero, S::less(vNext, vOne)));
+				}
+				S::store(pEnd + v, vNext);
+			}
+		}
+
+		template <typename S>
+		inline void wrapSimd(STYPE* pPhase, const STYPE* pOffset, const int nSamples)
+		{
+			using V = typename S::V;
+			int n = 0;
+			for (; n + S::Width <= nSamples; n += S::Width)
+			{
+				const V vPhase = S::add(S::load(pPhase + n), S::load(pOffset + n));
+				S::store(pPhase + n, S::sub(vPhase, S::floor(vPhase)));
+			}
+			wrapScalar(pPhase + n, pOffset + n, nSamples - n);
+		}
+
+		template <typename S>
+		inline void hardClipSimd(STYPE* pSamples, const int nSamples)
+		{
+			using V = typename S::V;
+			const V vLow = S::set(STYPE(-1.0));
+			const V vHigh = S::set(STYPE(1.0));
+			int n = 0;
+			for (; n + S::Width <= nSamples; n += S::Width)
+				S::store(pSamples + n, S::min(S::max(S::load(pSamples + n), vLow), vHigh));
+			hardClipScalar(pSamples + n, nSamples - n);
+		}
+
+		template <typename S>
+		inline void softClipSimd(STYPE* pSamples, const int nSamples)
+		{
+			using V = typename S::V;
+			const V vSign = S::set(STYPE(-0.0));
+			const V vZero = S::set(STYPE(0));
+			const V vKnee = S::set(STYPE(SoftKnee));
+			const V vWidth = S::set(STYPE(2.0 * (1.0 - SoftKnee)));
+			const V vBend = S::set(STYPE(SoftBend));
+			int n = 0;
+			for (; n + S::Width <= nSamples; n += S::Width)
+			{
+				const V vSample = S::load(pSamples + n);
+				const V vAbs = S::andNot(vSign, vSample);
+				const V vOver = S::min(S::max(S::sub(vAbs, vKnee), vZero), vWidth);
+				const V vClipped = S::add(S::min(vAbs, vKnee), S::mulAdd(S::mul(vOver, vOver), vBend, vOver));
+				S::store(pSamples + n, S::bitOr(vClipped, S::bitAnd(vSign, vSample)));
+			}
+			softClipScalar(pSamples + n, nSamples - n);
+		}
+
+		template <typename S>
+		inline void toInt16Simd(int16_t* pOutput, const STYPE* pInput, const int nSamples)
+		{
+			using V = typename S::V;
+			const V vScale = S::set(STYPE(Int16FullScale));
+			const V vLow = S::set(STYPE(-Int16FullScale - 1.0));
+			int n = 0;
+			for (; n + S::Width <= nSamples; n += S::Width)
+				S::toInt16(pOutput + n, S::min(S::max(S::mul(S::load(pInput + n), vScale), vLow), vScale));
+			toInt16Scalar(pOutput + n, pInput + n, nSamples - n);
+		}
+
+		template <typename S>
+		inline void toInt24Simd(uint8_t* pOutput, const STYPE* pInput, const int nSamples)
+		{
+			using V = typename S::V;
+			const V vScale = S::set(STYPE(Int24FullScale));
+			const V vLow = S::set(STYPE(-Int24FullScale - 1.0));
+			int n = 0;
+			for (; n + S::Width <= nSamples; n += S::Width)
+				S::toInt24(pOutput + 3 * n, S::min(S::max(S::mul(S::load(pInput + n), vScale), vLow), vScale));
+			toInt24Scalar(pOutput + 3 * n, pInput + n, nSamples - n);
+		}
+
+		template <typename S>
+		inline void toFloat32Simd(float* pOutput, const STYPE* pInput, const int nSamples)
+		{
+			int n = 0;
+			for (; n + S::Width <= nSamples; n += S::Width)
+				S::toFloat32(pOutput + n, S::load(pInput + n));
+			toFloat32Scalar(pOutput + n, pInput + n, nSamples - n);
+		}
+
+		//////////////////////////////////////////////////////////////////////////
+		// AVX2 + FMA, 256 bits at a time
+
+		SYNTH_TARGET_AVX2 SYNTH_FLATTEN void sineAVX2(STYPE* pOutput, const STYPE* pPhase, const int nSamples, const STYPE dAmp)
+		{
+			sineSimd<AVX2<STYPE>>(pOutput, pPhase, nSamples, dAmp);
+		}
+
+		SYNTH_TARGET_AVX2 SYNTH_FLATTEN void squareAVX2(STYPE* pOutput, const STYPE* pPhase, const int nSamples, const STYPE dAmp)
+		{
+			squareSimd<AVX2<STYPE>>(pOutput, pPhase, nSamples, dAmp);
+		}
+
+		SYNTH_TARGET_AVX2 SYNTH_FLATTEN void triangleAVX2(STYPE* pOutput, const STYPE* pPhase, const int nSamples, const STYPE dAmp)
+		{
+			triangleSimd<AVX2<STYPE>>(pOutput, pPhase, nSamples, dAmp);
+		}
+
+		SYNTH_TARGET_AVX2 SYNTH_FLATTEN void sawAVX2(STYPE* pOutput, const STYPE* pPhase, const int nSamples, const STYPE dAmp)
+		{
+			sawSimd<AVX2<STYPE>>(pOutput, pPhase, nSamples, dAmp);
+		}
+
+		SYNTH_TARGET_AVX2 SYNTH_FLATTEN void advanceAVX2(STYPE* pPhase, const FTYPE* pStart, const FTYPE* pInc, FTYPE* pEnd, const int nLanes, const int nSamples)
+		{
+			advanceSimd<AVX2<FTYPE>>(pPhase, pStart, pInc, pEnd, nLanes, nSamples);
+		}
+
+		SYNTH_TARGET_AVX2 SYNTH_FLATTEN void wrapAVX2(STYPE* pPhase, const STYPE* pOffset, const int nSamples)
+		{
+			wrapSimd<AVX2<STYPE>>(pPhase, pOffset, nSamples);
+		}
+
+		const WaveKernels AVX2Kernels = { "avx2", sineAVX2, squareAVX2, triangleAVX2, sawAVX2, advanceAVX2, wrapAVX2 };
+
+		SYNTH_TARGET_AVX2 SYNTH_FLATTEN void hardClipAVX2(STYPE* pSamples, const int nSamples)
+		{
+			hardClipSimd<AVX2<STYPE>>(pSamples, nSamples);
+		}
+
+		SYNTH_TARGET_AVX2 SYNTH_FLATTEN void softClipAVX2(STYPE* pSamples, const int nSamples)
+		{
+			softClipSimd<AVX2<STYPE>>(pSamples, nSamples);
+		}
+
+		SYNTH_TARGET_AVX2 SYNTH_FLATTEN void toInt16AVX2(int16_t* pOutput, const STYPE* pInput, const int nSamples)
+		{
+			toInt16Simd<AVX2<STYPE>>(pOutput, pInput, nSamples);
+		}
+
+		SYNTH_TARGET_AVX2 SYNTH_FLATTEN void toInt24AVX2(uint8_t* pOutput, const STYPE* pInput, const int nSamples)
+		{
+			toInt24Simd<AVX2<STYPE>>(pOutput, pInput, nSamples);
+		}
+
+		SYNTH_TARGET_AVX2 SYNTH_FLATTEN void toFloat32AVX2(float* pOutput, const STYPE* pInput, const int nSamples)
+		{
+			toFloat32Simd<AVX2<STYPE>>(pOutput, pInput, nSamples);
+		}
+
+		const OutputKernels AVX2OutputKernels = { "avx2", hardClipAVX2, softClipAVX2, toInt16AVX2, toInt24AVX2, toFloat32AVX2 };
+
+		//////////////////////////////////////////////////////////////////////////
+		// SSE4.1, 128 bits at a time
+
+		SYNTH_TARGET_SSE41 SYNTH_FLATTEN void sineSSE41(STYPE* pOutput, const STYPE* pPhase, const int nSamples, const STYPE dAmp)
+		{
+			sineSimd<SSE41<STYPE>>(pOutput, pPhase, nSamples, dAmp);
+		}
+
+		SYNTH_TARGET_SSE41 SYNTH_FLATTEN void squareSSE41(STYPE* pOutput, const STYPE* pPhase, const int nSamples, const STYPE dAmp)
+		{
+			squareSimd<SSE41<STYPE>>(pOutput, pPhase, nSamples, dAmp);
+		}
+
+		SYNTH_TARGET_SSE41 SYNTH_FLATTEN void triangleSSE41(STYPE* pOutput, const STYPE* pPhase, const int nSamples, const STYPE dAmp)
+		{
+			triangleSimd<SSE41<STYPE>>(pOutput, pPhase, nSamples, dAmp);
+		}
+
+		SYNTH_TARGET_SSE41 SYNTH_FLATTEN void sawSSE41(STYPE* pOutput, const STYPE* pPhase, const int nSamples, const STYPE dAmp)
+		{
+			sawSimd<SSE41<STYPE>>(pOutput, pPhase, nSamples, dAmp);
+		}
+
+		SYNTH_TARGET_SSE41 SYNTH_FLATTEN void advanceSSE41(STYPE* pPhase, const FTYPE* pStart, const FTYPE* pInc, FTYPE* pEnd, const int nLanes, const int nSamples)
+		{
+			advanceSimd<SSE41<FTYPE>>(pPhase, pStart, pInc, pEnd, nLanes, nSamples);
+		}
+
+		SYNTH_TARGET_SSE41 SYNTH_FLATTEN void wrapSSE41(STYPE* pPhase, const STYPE* pOffset, const int nSamples)
+		{
+			wrapSimd<SSE41<STYPE>>(pPhase, pOffset, nSamples);
+		}
+
+		const WaveKernels SSE41Kernels = { "sse4.1", sineSSE41, squareSSE41, triangleSSE41, sawSSE41, advanceSSE41, wrapSSE41 };
+
+		SYNTH_TARGET_SSE41 SYNTH_FLATTEN void hardClipSSE41(STYPE* pSamples, const int nSamples)
+		{
+			hardClipSimd<SSE41<STYPE>>(pSamples, nSamples);
+		}
+
+		SYNTH_TARGET_SSE41 SYNTH_FLATTEN void softClipSSE41(STYPE* pSamples, const int nSamples)
+		{
+			softClipSimd<SSE41<STYPE>>(pSamples, nSamples);
+		}
+
+		SYNTH_TARGET_SSE41 SYNTH_FLATTEN void toInt16SSE41(int16_t* pOutput, const STYPE* pInput, const int nSamples)
+		{
+			toInt16Simd<SSE41<STYPE>>(pOutput, pInput, nSamples);
+		}
+
+		SYNTH_TARGET_SSE41 SYNTH_FLATTEN void toInt24SSE41(uint8_t* pOutput, const STYPE* pInput, const int nSamples)
+		{
+			toInt24Simd<SSE41<STYPE>>(pOutput, pInput, nSamples);
+		}
+
+		SYNTH_TARGET_SSE41 SYNTH_FLATTEN void toFloat32SSE41(float* pOutput, const STYPE* pInput, const int nSamples)
+		{
+			toFloat32Simd<SSE41<STYPE>>(pOutput, pInput, nSamples);
+		}
+
+		const OutputKernels SSE41OutputKernels = { "sse4.1", hardClipSSE41, softClipSSE41, toInt16SSE41, toInt24SSE41, toFloat32SSE41 };
+
+		//////////////////////////////////////////////////////////////////////////
+		// CPU detection
+
+		struct CpuFeatures
+		{
+			bool bSSE41 = false;
+			bool bAVX2 = false;	// With FMA, and the OS saves the AVX registers
+		};
+
+		CpuFeatures cpuFeatures()
+		{
+			CpuFeatures features;
+#if defined(_MSC_VER)
+			int info[4];
+			__cpuid(info, 0);
+			const int nMaxLeaf = info[0];
+			__cpuid(info, 1);
+			features.bSSE41 = (info[2] & (1 << 19)) != 0;
+			const bool bFMA = (info[2] & (1 << 12)) != 0;
+			const bool bOSXSave = (info[2] & (1 << 27)) != 0;
+			const bool bAVX = (info[2] & (1 << 28)) != 0;
+			if (nMaxLeaf >= 7 && bFMA && bOSXSave && bAVX && (_xgetbv(0) & 0x6) == 0x6)
+			{
+				__cpuidex(info, 7, 0);
+				features.bAVX2 = (info[1] & (1 << 5)) != 0;
+			}
+#else
+			__builtin_cpu_init();
+			features.bSSE41 = __builtin_cpu_supports("sse4.1");
+			features.bAVX2 = __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+#endif
+			return features;
+		}
+#endif
+	}
+
+	namespace
+	{
+		// The kernel sets this CPU can run, fastest first
+		template <typename T>
+		struct KernelTable
+		{
+			const T* pKernels[3] = {};
+			size_t nCount = 0;
+
+			void add(const T& kernels) { pKernels[nCount++] = &kernels; }
+		};
+
+		KernelTable<WaveKernels> findWaveKernels()
+		{
+			KernelTable<WaveKernels> table;
+#ifdef SYNTH_X86_KERNELS
+			const auto features = cpuFeatures();
+			if (features.bAVX2)
+				table.add(AVX2Kernels);
+			if (features.bSSE41)
+				table.add(SSE41Kernels);
+#endif
+			table.add(ScalarKernels);
+			return table;
+		}
+
+		KernelTable<OutputKernels> findOutputKernels()
+		{
+			KernelTable<OutputKernels> table;
+#ifdef SYNTH_X86_KERNELS
+			const auto features = cpuFeatures();
+			if (features.bAVX2)
+				table.add(AVX2OutputKernels);
+			if (features.bSSE41)
+				table.add(SSE41OutputKernels);
+#endif
+			table.add(ScalarOutputKernels);
+			return table;
+		}
+
+		// Filled in before main(), so the audio thread only ever reads them
+		const KernelTable<WaveKernels> SupportedWaveKernels = findWaveKernels();
+		const KernelTable<OutputKernels> SupportedOutputKernels = findOutputKernels();
+	}
+
+	std::span<const WaveKernels* const> supportedWaveKernels()
+	{
+		return { SupportedWaveKernels.pKernels, SupportedWaveKernels.nCount };
+	}
+
+	const WaveKernels& waveKernels()
+	{
+		return *SupportedWaveKernels.pKernels[0];
+	}
+
+	std::span<const OutputKernels* const> supportedOutputKernels()
+	{
+		return { SupportedOutputKernels.pKernels, SupportedOutputKernels.nCount };
+	}
+
+	const OutputKernels& outputKernels()
+	{
+		return *SupportedOutputKernels.pKernels[0];
+	}
+}
@@ -0,0 +1,70 @@
+#pragma once
+
+#include <cstdint>
+#include <span>
+
+#include "Synth.h"
+
+namespace Synth
+{
+	// Block versions of waveform() for the waves that are computed rather than
+	// read from a table. Each adds dAmp times the wave at pPhase[n], in cycles,
+	// to pOutput[n]. Square, triangle and saw expect phases in [0, 1); sine
+	// accepts any phase. They work on STYPE, so a float build does twice as
+	// many samples per instruction.
+	//
+	// The sine is an odd degree 11 polynomial after folding the phase into a
+	// quarter cycle. In double its largest error is 1.33e-11 (about -217dB),
+	// far below what 16 or 24 bit output can show; in float it is limited by
+	// the float itself, around 1e-7.
+	//
+	// advance and wrap are the two halves of the oscillators' block tick().
+	// advance writes the phases of nLanes oscillators side by side, so
+	// pPhase[n * nLanes + v] is dStart[v] + n * dInc[v] wrapped into [0, 1),
+	// summed one sample at a time in FTYPE, and leaves the phase after the
+	// block in pEnd. The increments must be in [0, 1). wrap adds pOffset[n] to
+	// pPhase[n] and wraps the sum into [0, 1). Both give the same results in
+	// every kernel set.
+	struct WaveKernels
+	{
+		const char* name;
+		void (*sine)(STYPE* pOutput, const STYPE* pPhase, const int nSamples, const STYPE dAmp);
+		void (*square)(STYPE* pOutput, const STYPE* pPhase, const int nSamples, const STYPE dAmp);
+		void (*triangle)(STYPE* pOutput, const STYPE* pPhase, const int nSamples, const STYPE dAmp);
+		void (*saw)(STYPE* pOutput, const STYPE* pPhase, const int nSamples, const STYPE dAmp);
+		void (*advance)(STYPE* pPhase, const FTYPE* pStart, const FTYPE* pInc, FTYPE* pEnd, const int nLanes, const int nSamples);
+		void (*wrap)(STYPE* pPhase, const STYPE* pOffset, const int nSamples);
+	};
+
+	// The kernels this CPU can run, fastest first. The last is always plain C++.
+	// They are chosen while the program starts, so these must not be called
+	// from other files' static initialisers.
+	std::span<const WaveKernels* const> supportedWaveKernels();
+
+	// The fastest supported kernels
+	const WaveKernels& waveKernels();
+
+	// Full scale of the integer conversions below
+	constexpr FTYPE Int16FullScale = 32767.0;
+	constexpr FTYPE Int24FullScale = 8388607.0;
+
+	// Block steps of the output stage. The clips work in place. hardClip limits
+	// to [-1, 1]. softClip leaves anything within half of full scale alone, then
+	// bends smoothly (a quadratic knee) to reach full scale at 1.5, so loud
+	// peaks are rounded off instead of squared. The integer conversions scale
+	// by the full scale, round to nearest and saturate; 24 bit samples are
+	// packed into 3 bytes, little-endian.
+	struct OutputKernels
+	{
+		const char* name;
+		void (*hardClip)(STYPE* pSamples, const int nSamples);
+		void (*softClip)(STYPE* pSamples, const int nSamples);
+		void (*toInt16)(int16_t* pOutput, const STYPE* pInput, const int nSamples);
+		void (*toInt24)(uint8_t* pOutput, const STYPE* pInput, const int nSamples);
+		void (*toFloat32)(float* pOutput, const STYPE* pInput, const int nSamples);
+	};
+
+	// As for the wave kernels, fastest first and the last is always plain C++
+	std::span<const OutputKernels* const> supportedOutputKernels();
+	const OutputKernels& outputKernels();
+}
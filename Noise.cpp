@@ -0,0 +1,63 @@
+#include "Noise.h"
+
+namespace Synth
+{
+	void NoiseGenerator::seed(const uint64_t nSeed)
+	{
+		// splitmix64, so that neighbouring seeds give unrelated sequences
+		uint64_t z = nSeed + 0x9E3779B97F4A7C15ull;
+		z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+		z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+		z ^= z >> 31;
+		m_nState = z != 0 ? z : 0x9E3779B97F4A7C15ull; // xorshift must not start at 0
+
+		m_dPink[0] = m_dPink[1] = m_dPink[2] = 0.0;
+		m_dBrown = 0.0;
+	}
+
+	FTYPE NoiseGenerator::pink()
+	{
+		// Paul Kellet's economy filter, within 0.5dB of -3dB/octave above 10Hz
+		const FTYPE dWhite = white();
+		m_dPink[0] = 0.99765 * m_dPink[0] + dWhite * 0.0990460;
+		m_dPink[1] = 0.96300 * m_dPink[1] + dWhite * 0.2965164;
+		m_dPink[2] = 0.57000 * m_dPink[2] + dWhite * 1.0526913;
+		return 0.125 * (m_dPink[0] + m_dPink[1] + m_dPink[2] + dWhite * 0.1848);
+	}
+
+	FTYPE NoiseGenerator::brown()
+	{
+		// Leaky integrator, the leak keeps it from wandering off
+		m_dBrown = (m_dBrown + 0.02 * white()) / 1.02;
+		return 3.5 * m_dBrown;
+	}
+
+	void NoiseGenerator::white(STYPE* pOutput, const int nSamples, const FTYPE dAmp)
+	{
+		for (int n = 0; n < nSamples; ++n)
+			pOutput[n] += static_cast<STYPE>(dAmp * white());
+	}
+
+	void NoiseGenerator::pink(STYPE* pOutput, const int nSamples, const FTYPE dAmp)
+	{
+		for (int n = 0; n < nSamples; ++n)
+			pOutput[n] += static_cast<STYPE>(dAmp * pink());
+	}
+
+	void NoiseGenerator::brown(STYPE* pOutput, const int nSamples, const FTYPE dAmp)
+	{
+		for (int n = 0; n < nSamples; ++n)
+			pOutput[n] += static_cast<STYPE>(dAmp * brown());
+	}
+
+	void NoiseGenerator::triangular(STYPE* pOutput, const int nSamples, const FTYPE dAmp)
+	{
+		const FTYPE dScale = dAmp / 4294967296.0;
+		for (int n = 0; n < nSamples; ++n)
+		{
+			const uint64_t nBits = next();
+			const int64_t nDifference = static_cast<int64_t>(nBits >> 32) - static_cast<int64_t>(nBits & 0xFFFFFFFFu);
+			pOutput[n] += static_cast<STYPE>(dScale * static_cast<FTYPE>(nDifference));
+		}
+	}
+}
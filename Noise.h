@@ -0,0 +1,61 @@
+#pragma once
+
+#include <cstdint>
+
+#ifndef FTYPE
+#define FTYPE double
+#endif
+
+// Type of the audio sample buffers, see Synth.h
+#ifndef STYPE
+#define STYPE double
+#endif
+
+namespace Synth
+{
+	// Noise source with its own state, so voices never share a generator and
+	// rendering on several threads needs no locking. xorshift64* underneath.
+	// The same seed always produces the same noise, so offline renders are
+	// repeatable.
+	class NoiseGenerator
+	{
+	public:
+		NoiseGenerator() { seed(0); }
+		explicit NoiseGenerator(const uint64_t nSeed) { seed(nSeed); }
+
+		void seed(const uint64_t nSeed);
+
+		// White noise, uniform in [-1, 1)
+		FTYPE white()
+		{
+			return static_cast<FTYPE>(next() >> 11) * (2.0 / 9007199254740992.0) - 1.0;
+		}
+
+		// Pink (-3dB/octave) and brown (-6dB/octave) noise, filtered from the
+		// white noise and scaled so they seldom go outside [-1, 1]
+		FTYPE pink();
+		FTYPE brown();
+
+		// Block versions, which add dAmp times the noise to pOutput
+		void white(STYPE* pOutput, const int nSamples, const FTYPE dAmp);
+		void pink(STYPE* pOutput, const int nSamples, const FTYPE dAmp);
+		void brown(STYPE* pOutput, const int nSamples, const FTYPE dAmp);
+
+		// Adds dAmp times triangular (TPDF) noise in (-1, 1), the difference
+		// of two uniform values, for dither. One step of the generator gives both.
+		void triangular(STYPE* pOutput, const int nSamples, const FTYPE dAmp);
+
+	private:
+		uint64_t next()
+		{
+			m_nState ^= m_nState >> 12;
+			m_nState ^= m_nState << 25;
+			m_nState ^= m_nState >> 27;
+			return m_nState * 0x2545F4914F6CDD1Dull;
+		}
+
+		uint64_t m_nState = 0;
+		FTYPE m_dPink[3] = {};
+		FTYPE m_dBrown = 0.0;
+	};
+}
@@ -0,0 +1,101 @@
+#include "NoteIndex.h"
+
+#include <algorithm>
+#include <assert.h>
+#include <bit>
+
+namespace Synth
+{
+	namespace
+	{
+		// Fibonacci hashing, the multiply spreads nearby note IDs over the table
+		size_t hashKey(const Instrument* pInstrument, const int nNoteID)
+		{
+			const uint64_t nKey = reinterpret_cast<uintptr_t>(pInstrument) ^ static_cast<uint32_t>(nNoteID);
+			return static_cast<size_t>((nKey * 0x9E3779B97F4A7C15ull) >> 32);
+		}
+	}
+
+	NoteIndex::NoteIndex(const size_t nSlots)
+		: m_Entries(std::bit_ceil(std::max<size_t>(nSlots * 2, 2)))
+		, m_Links(nSlots)
+	{
+	}
+
+	size_t NoteIndex::entry(const Key& key) const
+	{
+		// Never full, so there is always an empty entry to stop at
+		const size_t nMask = m_Entries.size() - 1;
+		size_t i = hashKey(key.pInstrument, key.nNoteID) & nMask;
+		while (m_Entries[i].nSlot != NoSlot && !(m_Entries[i].key == key))
+			i = (i + 1) & nMask;
+		return i;
+	}
+
+	void NoteIndex::remove(size_t nEntry)
+	{
+		// Move later entries back into the gap unless that would put them
+		// before their home position, so lookups never need tombstones
+		const size_t nMask = m_Entries.size() - 1;
+		size_t j = nEntry;
+		while (true)
+		{
+			j = (j + 1) & nMask;
+			if (m_Entries[j].nSlot == NoSlot)
+				break;
+			const size_t nHome = hashKey(m_Entries[j].key.pInstrument, m_Entries[j].key.nNoteID) & nMask;
+			const bool bStays = (nEntry <= j) ? (nEntry < nHome && nHome <= j) : (nEntry < nHome || nHome <= j);
+			if (bStays)
+				continue;
+			m_Entries[nEntry] = m_Entries[j];
+			nEntry = j;
+		}
+		m_Entries[nEntry].nSlot = NoSlot;
+	}
+
+	void NoteIndex::insert(const Instrument* pInstrument, const int nNoteID, const size_t nSlot)
+	{
+		auto& link = m_Links[nSlot];
+		assert(!link.bIndexed);
+
+		const Key key = { pInstrument, nNoteID };
+		auto& e = m_Entries[entry(key)];
+		link.key = key;
+		link.nNewer = NoSlot;
+		link.nOlder = e.nSlot;
+		link.bIndexed = true;
+		if (link.nOlder != NoSlot)
+			m_Links[link.nOlder].nNewer = nSlot;
+		e.key = key;
+		e.nSlot = nSlot;
+	}
+
+	void NoteIndex::erase(const size_t nSlot)
+	{
+		auto& link = m_Links[nSlot];
+		if (!link.bIndexed)
+			return;
+		link.bIndexed = false;
+
+		if (link.nOlder != NoSlot)
+			m_Links[link.nOlder].nNewer = link.nNewer;
+		if (link.nNewer != NoSlot)
+		{
+			m_Links[link.nNewer].nOlder = link.nOlder;
+			return;
+		}
+
+		// It was the newest voice of the note
+		const size_t nEntry = entry(link.key);
+		assert(m_Entries[nEntry].nSlot == nSlot);
+		if (link.nOlder != NoSlot)
+			m_Entries[nEntry].nSlot = link.nOlder;
+		else
+			remove(nEntry);
+	}
+
+	size_t NoteIndex::find(const Instrument* pInstrument, const int nNoteID) const
+	{
+		return m_Entries[entry({ pInstrument, nNoteID })].nSlot;
+	}
+}
@@ -0,0 +1,63 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+#include "Synth.h"
+
+namespace Synth
+{
+	// Finds the voice playing a note on an instrument without searching every
+	// voice. Voices are known by their VoicePool slot. A note can be on several
+	// voices at once, when it is triggered again before the last one has died
+	// away, and find() returns the one added last. All of the memory is
+	// allocated by the constructor, and insert(), erase() and find() are O(1)
+	// on average and never allocate, so they are safe on the audio thread.
+	class NoteIndex
+	{
+	public:
+		static constexpr size_t NoSlot = SIZE_MAX;
+
+		explicit NoteIndex(const size_t nSlots);
+
+		// Indexes nSlot as playing nNoteID on pInstrument. nSlot must not already be indexed.
+		void insert(const Instrument* pInstrument, const int nNoteID, const size_t nSlot);
+
+		// Stops indexing nSlot, if it is
+		void erase(const size_t nSlot);
+
+		// The slot most recently indexed for the note, or NoSlot
+		size_t find(const Instrument* pInstrument, const int nNoteID) const;
+
+	private:
+		struct Key
+		{
+			const Instrument* pInstrument = nullptr;
+			int nNoteID = 0;
+
+			bool operator==(const Key&) const = default;
+		};
+
+		// Open addressing table, one entry for each note with any voices
+		struct Entry
+		{
+			Key key;
+			size_t nSlot = NoSlot;	// Newest voice of the note, NoSlot if the entry is empty
+		};
+
+		// Each indexed slot is in a list of the voices of its note, newest first
+		struct Link
+		{
+			Key key;
+			size_t nNewer = NoSlot;
+			size_t nOlder = NoSlot;
+			bool bIndexed = false;
+		};
+
+		size_t entry(const Key& key) const;
+		void remove(size_t nEntry);
+
+		std::vector<Entry> m_Entries;	// Power of two in size, never more than half full
+		std::vector<Link> m_Links;		// One for each slot
+	};
+}
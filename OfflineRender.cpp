@@ -0,0 +1,82 @@
+#include "OfflineRender.h"
+
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <vector>
+
+#include "AudioBackend.h"
+#include "Engine.h"
+
+namespace Synth
+{
+	namespace
+	{
+		constexpr unsigned int OfflineBlockSamples = 4096;
+	}
+
+	bool renderOffline(Engine& engine, Sequencer& sequencer, const std::string& sFileName, const uint64_t nSamples, const unsigned int nChannels, const WavSampleFormat nFormat, const ClipType nClip, const bool bDither, OfflineRenderStats& stats)
+	{
+		AudioFormat format;
+		format.nSampleRate = static_cast<unsigned int>(sampleRate());
+		format.nChannels = nChannels;
+		format.nBitsPerSample = (nFormat == WAV_FLOAT32) ? 32 : (nFormat == WAV_PCM24) ? 24 : 16;
+		format.bFloat = (nFormat == WAV_FLOAT32);
+		format.nBlocks = 1;
+		format.nBlockSamples = OfflineBlockSamples * nChannels;
+
+		std::vector<char> vBlock(format.bytesPerBlock());
+		FileAudioBackend file(sFileName);
+		if (!file.open(format, vBlock.data()))
+			return false;
+
+		std::vector<STYPE> vMix(format.nBlockSamples);
+		OutputStage output(format, nClip, bDither);
+		const auto start = std::chrono::steady_clock::now();
+
+		sequencer.Update(0);
+		uint64_t nSample = 0;
+		bool bOK = true;
+		while (bOK && nSample < nSamples)
+		{
+			const auto nCount = static_cast<unsigned int>(std::min<uint64_t>(OfflineBlockSamples, nSamples - nSample));
+
+			// Queue every note that starts in this block, then render it. A post
+			// only fails when the engine holds as many commands as it can, so play
+			// up to the note to let the earlier ones come due, and try again.
+			sequencer.Update(nSample + nCount);
+			unsigned int nDone = 0;
+			for (auto& sn : sequencer.vecNotes)
+			{
+				if (engine.noteTrigger(sn.pInstrument, sn.note.id, sn.note.velocity, sn.note.priority, sn.nSample))
+					continue;
+				const auto nUpTo = static_cast<unsigned int>(std::clamp<uint64_t>(sn.nSample, nSample + nDone, nSample + nCount) - nSample);
+				engine.render(vMix.data() + size_t(nDone) * nChannels, nUpTo - nDone, nSample + nDone, nChannels);
+				nDone = nUpTo;
+				if (!engine.noteTrigger(sn.pInstrument, sn.note.id, sn.note.velocity, sn.note.priority, sn.nSample))
+				{
+					std::cerr << "Offline render: cannot queue note " << sn.note.id << " at sample " << sn.nSample << '\n';
+					bOK = false;
+					break;
+				}
+			}
+			if (!bOK)
+				break;
+			engine.render(vMix.data() + size_t(nDone) * nChannels, nCount - nDone, nSample + nDone, nChannels);
+
+			const unsigned int nValues = nCount * nChannels;
+			output.process(vMix.data(), vBlock.data(), nValues);
+
+			// The last block can be short
+			bOK = file.write(vBlock.data(), size_t(nValues) * format.nBitsPerSample / 8);
+			nSample += nCount;
+		}
+		file.close();
+
+		stats.nSamples = nSample;
+		stats.dAudioSeconds = sampleToTime(nSample);
+		stats.dWallSeconds = std::chrono::duration<FTYPE>(std::chrono::steady_clock::now() - start).count();
+		stats.dRealTimeFactor = stats.dWallSeconds > 0.0 ? stats.dAudioSeconds / stats.dWallSeconds : 0.0;
+		return bOK;
+	}
+}
@@ -0,0 +1,36 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+
+#include "OutputStage.h"
+#include "Synth.h"
+
+namespace Synth
+{
+	class Engine;
+
+	enum WavSampleFormat
+	{
+		WAV_PCM16,
+		WAV_PCM24,
+		WAV_FLOAT32,
+	};
+
+	struct OfflineRenderStats
+	{
+		uint64_t nSamples = 0;
+		FTYPE dAudioSeconds = 0.0;
+		FTYPE dWallSeconds = 0.0;
+		FTYPE dRealTimeFactor = 0.0;	// Seconds of audio rendered per second of wall time
+	};
+
+	// Plays the sequencer through the engine for nSamples samples, at
+	// sampleRate(), and writes the result to a WAV file with nChannels
+	// channels, see Engine::render() for what goes in each. Nothing waits
+	// for a sound card, so this runs as fast as the CPU allows. The engine
+	// should have no voices playing, and the sequencer should not have been
+	// started yet. The mix goes through an OutputStage with nClip and, for
+	// integer formats, bDither; the dither is seeded, so renders repeat.
+	bool renderOffline(Engine& engine, Sequencer& sequencer, const std::string& sFileName, const uint64_t nSamples, const unsigned int nChannels, const WavSampleFormat nFormat, const ClipType nClip, const bool bDither, OfflineRenderStats& stats);
+}
@@ -0,0 +1,49 @@
+#include "OutputStage.h"
+
+#include <assert.h>
+#include <cstdint>
+
+#include "Kernels.h"
+
+namespace Synth
+{
+	OutputStage::OutputStage(const AudioFormat& format, const ClipType nClip, const bool bDither)
+		: m_Format(format)
+		, m_nClip(nClip)
+		, m_bDither(bDither)
+	{
+		assert(supports(format));
+	}
+
+	bool OutputStage::supports(const AudioFormat& format)
+	{
+		if (format.bFloat)
+			return format.nBitsPerSample == 32;
+		return format.nBitsPerSample == 16 || format.nBitsPerSample == 24;
+	}
+
+	void OutputStage::process(STYPE* pMix, void* pOutput, const size_t nSamples)
+	{
+		const OutputKernels& kernels = outputKernels();
+		const int nCount = static_cast<int>(nSamples);
+		if (m_nClip == CLIP_SOFT)
+			kernels.softClip(pMix, nCount);
+		else
+			kernels.hardClip(pMix, nCount);
+
+		// Floats keep far more resolution than any sound card, so need no dither
+		if (m_Format.bFloat)
+		{
+			kernels.toFloat32(static_cast<float*>(pOutput), pMix, nCount);
+			return;
+		}
+
+		const bool b24 = m_Format.nBitsPerSample == 24;
+		if (m_bDither)
+			m_Dither.triangular(pMix, nCount, 1.0 / (b24 ? Int24FullScale : Int16FullScale));
+		if (b24)
+			kernels.toInt24(static_cast<uint8_t*>(pOutput), pMix, nCount);
+		else
+			kernels.toInt16(static_cast<int16_t*>(pOutput), pMix, nCount);
+	}
+}
@@ -0,0 +1,42 @@
+#pragma once
+
+#include <cstddef>
+
+#include "AudioBackend.h"
+#include "Noise.h"
+
+namespace Synth
+{
+	enum ClipType
+	{
+		CLIP_HARD,
+		CLIP_SOFT,
+	};
+
+	// The last step before the sound card or a file. It limits the mix to
+	// full scale and converts it to the samples of an AudioFormat: 16 or 24
+	// bit integers, or 32 bit floats. Integer samples get triangular dither of
+	// one step first, which turns the distortion of rounding quiet passages
+	// into a steady hiss far below the music. Each step runs on the whole
+	// block with the kernels from Kernels.h, and nothing is allocated, so
+	// process() is safe on the audio thread.
+	class OutputStage
+	{
+	public:
+		OutputStage() = default;
+		explicit OutputStage(const AudioFormat& format, const ClipType nClip = CLIP_HARD, const bool bDither = true);
+
+		// Whether process() can write samples of this format
+		static bool supports(const AudioFormat& format);
+
+		// Converts nSamples samples of pMix, which are clipped and dithered
+		// in place, to pOutput in the format
+		void process(STYPE* pMix, void* pOutput, const size_t nSamples);
+
+	private:
+		AudioFormat m_Format;
+		ClipType m_nClip = CLIP_HARD;
+		bool m_bDither = true;
+		NoiseGenerator m_Dither;
+	};
+}
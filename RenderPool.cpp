@@ -0,0 +1,91 @@
+#include "RenderPool.h"
+
+#include <assert.h>
+
+namespace Synth
+{
+	RenderPool::RenderPool(const unsigned int nThreads)
+	{
+		for (unsigned int i = 1; i < nThreads; ++i)
+			m_Workers.emplace_back(&RenderPool::worker, this);
+	}
+
+	RenderPool::~RenderPool()
+	{
+		m_bQuit = true;
+		m_nBatch.fetch_add(1, std::memory_order_release);
+		m_nBatch.notify_all();
+		for (auto& t : m_Workers)
+			t.join();
+	}
+
+	void RenderPool::run(void (*pJob)(void* pContext, const size_t nJob), void* pContext, const size_t nJobs)
+	{
+		// Not worth waking anyone for
+		if (m_Workers.empty() || nJobs < 2)
+		{
+			for (size_t n = 0; n < nJobs; ++n)
+				pJob(pContext, n);
+			return;
+		}
+
+		// Every job of the last batch has finished, so no worker can claim one
+		// of its jobs any more, and the batch can be replaced
+		assert(nJobs <= MaxJobs);
+		const uint64_t nBatch = m_nBatch.load(std::memory_order_relaxed) + 1;
+		m_pJob.store(pJob, std::memory_order_relaxed);
+		m_pContext.store(pContext, std::memory_order_relaxed);
+		m_nJobsDone.store(0, std::memory_order_relaxed);
+		m_nNextJob.store((nBatch << 32) | (uint64_t(nJobs) << 16), std::memory_order_release);
+		m_nBatch.store(nBatch, std::memory_order_release);
+		m_nBatch.notify_all();
+
+		// Take jobs until there are none left to start, so a worker that is slow
+		// to wake only means more work here. What remains is jobs that other
+		// threads are running; spin for them, and yield if that takes a while,
+		// rather than sleep.
+		work();
+		for (int nSpin = 0; m_nJobsDone.load(std::memory_order_acquire) != nJobs; ++nSpin)
+		{
+			if (nSpin >= SpinsBeforeYield)
+				std::this_thread::yield();
+		}
+	}
+
+	void RenderPool::worker()
+	{
+		uint64_t nBatch = 0;
+		while (true)
+		{
+			m_nBatch.wait(nBatch, std::memory_order_acquire);
+			nBatch = m_nBatch.load(std::memory_order_acquire);
+			if (m_bQuit)
+				return;
+
+			work();
+		}
+	}
+
+	void RenderPool::work()
+	{
+		// A worker may still be looking at a batch that has finished while the
+		// next one is set up. Only a batch with jobs left to claim can be
+		// claimed from, and it can't be replaced until they are all done, so a
+		// claim that succeeds proves the job and context it read are current.
+		uint64_t nNext = m_nNextJob.load(std::memory_order_acquire);
+		while (true)
+		{
+			const auto pJob = m_pJob.load(std::memory_order_relaxed);
+			void* const pContext = m_pContext.load(std::memory_order_relaxed);
+			const size_t nJob = static_cast<size_t>(nNext & 0xffff);
+			if (nJob >= static_cast<size_t>((nNext >> 16) & 0xffff))
+				return;
+			if (!m_nNextJob.compare_exchange_weak(nNext, nNext + 1, std::memory_order_acquire))
+				continue;
+
+			pJob(pContext, nJob);
+			m_nJobsDone.fetch_add(1, std::memory_order_release);
+			nNext = m_nNextJob.load(std::memory_order_acquire);
+		}
+	}
+}
@@ -0,0 +1,55 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <thread>
+#include <vector>
+
+namespace Synth
+{
+	// Worker threads that share out a batch of independent jobs, such as the
+	// voices of one block. The calling thread works on the batch too. Every
+	// thread claims the next unstarted job from one shared counter; there are
+	// no per-thread queues and no stealing, so a thread that draws cheap jobs
+	// simply takes more of them. Nothing is allocated or locked per batch, and
+	// the caller never sleeps: it runs whatever no worker has started, then
+	// spins only for jobs still running on other threads. So run() is safe to
+	// call from the audio thread.
+	class RenderPool
+	{
+	public:
+		// nThreads counts the calling thread, so 0 or 1 runs every job on the caller
+		explicit RenderPool(const unsigned int nThreads);
+		~RenderPool();
+
+		RenderPool(const RenderPool&) = delete;
+		RenderPool& operator=(const RenderPool&) = delete;
+
+		static constexpr size_t MaxJobs = 0xffff;
+
+		unsigned int threads() const { return static_cast<unsigned int>(m_Workers.size()) + 1; }
+
+		// Calls pJob(pContext, n) once for each n in [0, nJobs), in no particular
+		// order and on any of the threads, and returns when they have all finished.
+		// nJobs is at most MaxJobs.
+		void run(void (*pJob)(void* pContext, const size_t nJob), void* pContext, const size_t nJobs);
+
+	private:
+		static constexpr int SpinsBeforeYield = 4096;	// Checks for the last jobs to finish before yielding
+
+		void worker();
+		void work();
+
+		std::vector<std::thread> m_Workers;
+		std::atomic<uint64_t> m_nBatch = 0;			// Bumped to wake the workers for a new batch
+		std::atomic<uint64_t> m_nNextJob = 0;		// Batch number in bits 32-63, its job count in 16-31, the next job to claim in 0-15
+		std::atomic<size_t> m_nJobsDone = 0;
+		std::atomic<bool> m_bQuit = false;
+
+		// The current batch. A worker can read these while the next batch is
+		// being set up, see work(), so they are atomic.
+		std::atomic<void (*)(void*, const size_t)> m_pJob = nullptr;
+		std::atomic<void*> m_pContext = nullptr;
+	};
+}
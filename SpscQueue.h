@@ -0,0 +1,45 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+
+namespace Synth
+{
+	// Bounded single producer / single consumer queue.
+	// push() may only be called from one thread and pop() from one (other) thread.
+	// Neither ever blocks or allocates, so the consumer can be the audio thread.
+	template <typename T, size_t Capacity>
+	class SpscQueue
+	{
+		static_assert(Capacity > 0 && (Capacity & (Capacity - 1)) == 0, "Capacity must be a power of two");
+
+	public:
+		// Returns false, and drops item, if the queue is full
+		bool push(const T& item)
+		{
+			const size_t nTail = m_nTail.load(std::memory_order_relaxed);
+			if (nTail - m_nHead.load(std::memory_order_acquire) == Capacity)
+				return false;
+			m_Items[nTail & (Capacity - 1)] = item;
+			m_nTail.store(nTail + 1, std::memory_order_release);
+			return true;
+		}
+
+		// Returns false if the queue is empty
+		bool pop(T& item)
+		{
+			const size_t nHead = m_nHead.load(std::memory_order_relaxed);
+			if (nHead == m_nTail.load(std::memory_order_acquire))
+				return false;
+			item = m_Items[nHead & (Capacity - 1)];
+			m_nHead.store(nHead + 1, std::memory_order_release);
+			return true;
+		}
+
+	private:
+		std::array<T, Capacity> m_Items;
+		std::atomic<size_t> m_nHead = 0;
+		std::atomic<size_t> m_nTail = 0;
+	};
+}
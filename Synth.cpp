@@ -1,5 +1,9 @@
 #include "Synth.h"
+#include "Kernels.h"
+#include "Wavetable.h"
+#include <algorithm>
 #include <assert.h>
+#include <cmath>
 #include <fstream>
 #include <iostream>
 
@@ -40,6 +44,8 @@ namespace Synth
 			return (2.0 / PI) * (dHertz * PI * fmod(dTime, 1.0 / dHertz) - (PI / 2.0));
 
 		case OSC_NOISE:
+		case OSC_NOISE_PINK:
+		case OSC_NOISE_BROWN:
 			return 2.0 * ((FTYPE)rand() / (FTYPE)RAND_MAX) - 1.0;
 		}
 
@@ -68,23 +74,389 @@ namespace Synth
 		return oscillator2(dTime, dHertz, nType, dFreq, dCustom);
 	}
 
-	//////////////////////////////////////////////////////////////////////////////
-	// Scale to Frequency conversion
+	namespace
+	{
+		FTYPE g_dSampleRate = 44100.0;
+	}
+
+	void setSampleRate(const FTYPE dSampleRate)
+	{
+		g_dSampleRate = dSampleRate;
+	}
+
+	FTYPE sampleRate()
+	{
+		return g_dSampleRate;
+	}
+
+	FTYPE sampleToTime(const uint64_t nSample)
+	{
+		return static_cast<FTYPE>(nSample) / g_dSampleRate;
+	}
+
+	FTYPE waveform(const WaveType nType, const FTYPE dPhase, const FTYPE dCustom)
+	{
+		switch (nType)
+		{
+		case OSC_SINE: // Sine wave bewteen -1 and +1
+			return sin(f2w(dPhase));
+
+		case OSC_SQUARE: // Square wave between -1 and +1
+			return dPhase < 0.5 ? 1.0 : -1.0;
+
+		case OSC_TRIANGLE: // Triangle wave between -1 and +1, in phase with the sine
+		{
+			FTYPE dShifted = dPhase - 0.25;
+			dShifted -= floor(dShifted);
+			return 4.0 * fabs(dShifted - 0.5) - 1.0;
+		}
+
+		case OSC_SAW_ANA: // Saw wave (analogue / warm / slow)
+		{
+			FTYPE dOutput = 0.0;
+			const FTYPE dAngle = f2w(dPhase);
+			for (FTYPE n = 1.0; n < dCustom; ++n)
+				dOutput += (sin(n * dAngle)) / n;
+			return dOutput * (2.0 / PI);
+		}
+
+		case OSC_SAW_DIG:
+			return 2.0 * dPhase - 1.0;
+
+		case OSC_NOISE: // Stateless, so pink and brown are only approximated by white here
+		case OSC_NOISE_PINK:
+		case OSC_NOISE_BROWN:
+			return 2.0 * ((FTYPE)rand() / (FTYPE)RAND_MAX) - 1.0;
+		}
+
+		assert(false);
+		return 0.0;
+	}
+
+	void Oscillator::start(const WaveType nWaveType, const FTYPE dHertz, const FTYPE dLFOHertz, const FTYPE dLFOAmplitude, const Wavetable* pWavetable)
+	{
+		nType = nWaveType;
+		pTable = pWavetable ? pWavetable->select(dHertz, g_dSampleRate) : nullptr;
+		dPhase = 0.0;
+		dPhaseInc = dHertz / g_dSampleRate;
+		dLFOPhase = 0.0;
+		dLFOPhaseInc = dLFOHertz / g_dSampleRate;
+		// oscillator() adds dLFOAmplitude * dHertz radians at the peak of the LFO
+		dLFODepth = dLFOAmplitude * dHertz / f2w(1.0);
+	}
+
+	FTYPE Oscillator::tick()
+	{
+		FTYPE dOut = dPhase;
+		if (dLFODepth != 0.0)
+		{
+			dOut += dLFODepth * sin(f2w(dLFOPhase));
+			dOut -= floor(dOut);
+		}
+
+		dPhase += dPhaseInc;
+		dPhase -= floor(dPhase);
+		dLFOPhase += dLFOPhaseInc;
+		dLFOPhase -= floor(dLFOPhase);
+		return dOut;
+	}
+
+	namespace
+	{
+		// PolyBLEP: the difference between a band-limited and a naive step from -1 to +1
+		// at phase 0, spread over one sample either side of it. dt is the phase increment.
+		inline FTYPE polyBLEP(FTYPE t, const FTYPE dt)
+		{
+			if (t < dt)
+			{
+				t /= dt;
+				return t + t - t * t - 1.0;
+			}
+			if (t > 1.0 - dt)
+			{
+				t = (t - 1.0) / dt;
+				return t * t + t + t + 1.0;
+			}
+			return 0.0;
+		}
+
+		// PolyBLAMP: the integral of polyBLEP(), for a change of slope of 2 per sample at phase 0
+		inline FTYPE polyBLAMP(FTYPE t, const FTYPE dt)
+		{
+			if (t < dt)
+			{
+				t = t / dt - 1.0;
+				return -1.0 / 3.0 * t * t * t;
+			}
+			if (t > 1.0 - dt)
+			{
+				t = (t - 1.0) / dt + 1.0;
+				return 1.0 / 3.0 * t * t * t;
+			}
+			return 0.0;
+		}
+
+		inline FTYPE wrap(const FTYPE dPhase)
+		{
+			return dPhase - floor(dPhase);
+		}
+
+		// What to add to waveform(T, dPhase) to remove most of its aliasing
+		template <WaveType T>
+		inline FTYPE antialias(const FTYPE dPhase, const FTYPE dt)
+		{
+			if constexpr (T == OSC_SQUARE) // Up at 0, down at 0.5
+				return polyBLEP(dPhase, dt) - polyBLEP(wrap(dPhase + 0.5), dt);
+			else if constexpr (T == OSC_SAW_DIG) // Down at 0
+				return -polyBLEP(dPhase, dt);
+			else if constexpr (T == OSC_TRIANGLE) // Slope goes from +4 to -4 cycles at 0.25, and back at 0.75
+				return 4.0 * dt * (polyBLAMP(wrap(dPhase + 0.25), dt) - polyBLAMP(wrap(dPhase - 0.25), dt));
+			else
+				return 0.0;
+		}
+
+		inline FTYPE antialias(const WaveType nType, const FTYPE dPhase, const FTYPE dt)
+		{
+			switch (nType)
+			{
+			case OSC_SQUARE:
+				return antialias<OSC_SQUARE>(dPhase, dt);
+			case OSC_SAW_DIG:
+				return antialias<OSC_SAW_DIG>(dPhase, dt);
+			case OSC_TRIANGLE:
+				return antialias<OSC_TRIANGLE>(dPhase, dt);
+			default:
+				return 0.0;
+			}
+		}
 
-	FTYPE scale(const int nNoteID, const int /*nScaleID = SCALE_DEFAULT*/)
+		// Writes the vibrato of the block to pOffset[n * nStride]. It is evaluated
+		// every nLFOInterval samples, and at the end of the block, then
+		// interpolated linearly in between.
+		void vibrato(const Oscillator& osc, STYPE* pOffset, const int nSamples, const size_t nStride)
+		{
+			const int nInterval = std::max(osc.nLFOInterval, 1);
+			const int nPoints = (nSamples + nInterval - 1) / nInterval + 1;
+			STYPE dLFOPhases[MaxBlockSamples + 1];
+			STYPE dLFO[MaxBlockSamples + 1] = {};
+			for (int p = 0; p < nPoints; ++p)
+			{
+				const int nOffset = std::min(p * nInterval, nSamples);
+				dLFOPhases[p] = static_cast<STYPE>(wrap(osc.dLFOPhase + nOffset * osc.dLFOPhaseInc));
+			}
+			waveKernels().sine(dLFO, dLFOPhases, nPoints, static_cast<STYPE>(osc.dLFODepth));
+
+			for (int p = 0; p + 1 < nPoints; ++p)
+			{
+				const int nStart = p * nInterval;
+				const int nEnd = std::min(nStart + nInterval, nSamples);
+				const STYPE dSlope = (dLFO[p + 1] - dLFO[p]) / static_cast<STYPE>(nEnd - nStart);
+				for (int n = nStart; n < nEnd; ++n)
+					pOffset[n * nStride] = dLFO[p] + dSlope * static_cast<STYPE>(n - nStart);
+			}
+		}
+
+		// The LFO half of the block tick(), for nLanes interleaved phases that
+		// have already been advanced
+		template <bool bLFO>
+		void modulate(Oscillator* const* pOscillators, const size_t nLanes, STYPE* pPhase, const int nSamples)
+		{
+			if constexpr (bLFO)
+			{
+				alignas(64) STYPE dOffset[MaxBlockSamples * MaxBatchVoices];
+				for (size_t v = 0; v < nLanes; ++v)
+					vibrato(*pOscillators[v], dOffset + v, nSamples, nLanes);
+				waveKernels().wrap(pPhase, dOffset, nSamples * static_cast<int>(nLanes));
+			}
+
+			for (size_t v = 0; v < nLanes; ++v)
+			{
+				Oscillator& osc = *pOscillators[v];
+				osc.dLFOPhase += nSamples * osc.dLFOPhaseInc;
+				osc.dLFOPhase -= floor(osc.dLFOPhase);
+			}
+		}
+
+		template <bool bLFO>
+		void tickBlock(Oscillator* const* pOscillators, const size_t nLanes, STYPE* pPhase, const int nSamples)
+		{
+			assert(nSamples <= MaxBlockSamples && nLanes <= MaxBatchVoices);
+			FTYPE dStart[MaxBatchVoices];
+			FTYPE dInc[MaxBatchVoices];
+			FTYPE dEnd[MaxBatchVoices];
+			bool bBelowRate = true;
+			for (size_t v = 0; v < nLanes; ++v)
+			{
+				dStart[v] = pOscillators[v]->dPhase;
+				dInc[v] = pOscillators[v]->dPhaseInc;
+				bBelowRate = bBelowRate && dInc[v] >= 0.0 && dInc[v] < 1.0;
+			}
+
+			if (bBelowRate)
+			{
+				// Below the sample rate the phase gains less than a cycle per
+				// sample, so one compare wraps it exactly as floor() would. With
+				// no library call left, the kernel runs the lanes side by side.
+				waveKernels().advance(pPhase, dStart, dInc, dEnd, static_cast<int>(nLanes), nSamples);
+			}
+			else
+			{
+				for (size_t v = 0; v < nLanes; ++v)
+				{
+					FTYPE dNext = dStart[v];
+					for (int n = 0; n < nSamples; ++n)
+					{
+						pPhase[n * nLanes + v] = static_cast<STYPE>(dNext);
+						dNext += dInc[v];
+						dNext -= floor(dNext);
+					}
+					dEnd[v] = dNext;
+				}
+			}
+
+			for (size_t v = 0; v < nLanes; ++v)
+				pOscillators[v]->dPhase = dEnd[v];
+			modulate<bLFO>(pOscillators, nLanes, pPhase, nSamples);
+		}
+
+		// Adds dAmp times lane v's noise to pOutput[n * nLanes + v]
+		template <WaveType T>
+		void addNoise(Oscillator& osc, STYPE* pOutput, const size_t nLanes, const int nSamples, const FTYPE dAmp)
+		{
+			STYPE dNoise[MaxBlockSamples] = {};
+			STYPE* pNoise = (nLanes == 1) ? pOutput : dNoise;
+			if constexpr (T == OSC_NOISE)
+				osc.noise.white(pNoise, nSamples, dAmp);
+			else if constexpr (T == OSC_NOISE_PINK)
+				osc.noise.pink(pNoise, nSamples, dAmp);
+			else
+				osc.noise.brown(pNoise, nSamples, dAmp);
+			if (nLanes == 1)
+				return;
+			for (int n = 0; n < nSamples; ++n)
+				pOutput[n * nLanes] += dNoise[n];
+		}
+
+		template <WaveType T>
+		void shapeBlock(Oscillator* const* pOscillators, const size_t nLanes, STYPE* pOutput, const STYPE* pPhase, const int nSamples, const FTYPE dAmp)
+		{
+			// The computed waves depend only on the phase, so every lane is done in one call
+			const int nValues = nSamples * static_cast<int>(nLanes);
+			const STYPE dGain = static_cast<STYPE>(dAmp);
+			if constexpr (T == OSC_SINE)
+				waveKernels().sine(pOutput, pPhase, nValues, dGain);
+			else if constexpr (T == OSC_SQUARE)
+				waveKernels().square(pOutput, pPhase, nValues, dGain);
+			else if constexpr (T == OSC_TRIANGLE)
+				waveKernels().triangle(pOutput, pPhase, nValues, dGain);
+			else if constexpr (T == OSC_SAW_DIG)
+				waveKernels().saw(pOutput, pPhase, nValues, dGain);
+			else if constexpr (T == OSC_SAW_ANA) // Only without a wavetable, which is rare
+			{
+				for (int n = 0; n < nValues; ++n)
+					pOutput[n] += static_cast<STYPE>(dAmp * waveform(OSC_SAW_ANA, pPhase[n]));
+			}
+			else
+			{
+				for (size_t v = 0; v < nLanes; ++v)
+					addNoise<T>(*pOscillators[v], pOutput + v, nLanes, nSamples, dAmp);
+			}
+
+			// Only the samples next to a corner get a correction
+			if constexpr (T == OSC_SQUARE || T == OSC_TRIANGLE || T == OSC_SAW_DIG)
+			{
+				for (size_t v = 0; v < nLanes; ++v)
+				{
+					const FTYPE dt = pOscillators[v]->dPhaseInc;
+					for (int n = 0; n < nSamples; ++n)
+					{
+						const size_t k = n * nLanes + v;
+						pOutput[k] += static_cast<STYPE>(dAmp * antialias<T>(pPhase[k], dt));
+					}
+				}
+			}
+		}
+
+		void shapeTable(Oscillator* const* pOscillators, const size_t nLanes, STYPE* pOutput, const STYPE* pPhase, const int nSamples, const FTYPE dAmp)
+		{
+			// Each lane has the table for its own pitch
+			const STYPE dGain = static_cast<STYPE>(dAmp);
+			for (size_t v = 0; v < nLanes; ++v)
+			{
+				const STYPE* pTable = pOscillators[v]->pTable;
+				for (int n = 0; n < nSamples; ++n)
+				{
+					const size_t k = n * nLanes + v;
+					pOutput[k] += dGain * Wavetable::read(pTable, pPhase[k]);
+				}
+			}
+		}
+
+		template <bool bLFO>
+		constexpr OscillatorKernel OscillatorKernels[] =
+		{
+			{ tickBlock<bLFO>, shapeBlock<OSC_SINE> },
+			{ tickBlock<bLFO>, shapeBlock<OSC_SQUARE> },
+			{ tickBlock<bLFO>, shapeBlock<OSC_TRIANGLE> },
+			{ tickBlock<bLFO>, shapeBlock<OSC_SAW_ANA> },
+			{ tickBlock<bLFO>, shapeBlock<OSC_SAW_DIG> },
+			{ tickBlock<bLFO>, shapeBlock<OSC_NOISE> },
+			{ tickBlock<bLFO>, shapeBlock<OSC_NOISE_PINK> },
+			{ tickBlock<bLFO>, shapeBlock<OSC_NOISE_BROWN> },
+		};
+		static_assert(std::size(OscillatorKernels<false>) == OSC_NOISE_BROWN + 1, "one kernel per WaveType");
+
+		constexpr OscillatorKernel TableKernels[] = { { tickBlock<false>, shapeTable }, { tickBlock<true>, shapeTable } };
+	}
+
+	const OscillatorKernel& oscillatorKernel(const WaveType nType, const bool bLFO, const bool bTable)
 	{
-		//constexpr double twoPowerOneTwelth = pow(2.0, (1.0 / 12.0));
-		constexpr double twoPowerOneTwelth = 1.0594630943592952645618252949463;
-		return 8 * pow(twoPowerOneTwelth, nNoteID);
-		/*switch (nScaleID)
+		if (bTable)
+			return TableKernels[bLFO];
+		assert(nType >= 0 && nType < static_cast<int>(std::size(OscillatorKernels<false>)));
+		return bLFO ? OscillatorKernels<true>[nType] : OscillatorKernels<false>[nType];
+	}
+
+	FTYPE Oscillator::shape(const FTYPE dAtPhase)
+	{
+		if (pTable)
+			return Wavetable::read(pTable, static_cast<STYPE>(dAtPhase));
+
+		switch (nType)
 		{
-		case SCALE_DEFAULT:
+		case OSC_NOISE:
+			return noise.white();
+		case OSC_NOISE_PINK:
+			return noise.pink();
+		case OSC_NOISE_BROWN:
+			return noise.brown();
 		default:
-			return 8 * pow(twoPowerOneTwelth, nNoteID);
+			return waveform(nType, dAtPhase) + antialias(nType, dAtPhase, dPhaseInc);
 		}
-		*/
 	}
 
+	void Oscillator::tick(STYPE* pPhase, const int nSamples)
+	{
+		Oscillator* pThis = this;
+		if (dLFODepth != 0.0)
+			tickBlock<true>(&pThis, 1, pPhase, nSamples);
+		else
+			tickBlock<false>(&pThis, 1, pPhase, nSamples);
+	}
+
+	void Oscillator::shape(STYPE* pOutput, const STYPE* pPhase, const int nSamples, const FTYPE dAmp)
+	{
+		Oscillator* pThis = this;
+		oscillatorKernel(nType, false, pTable != nullptr).shape(&pThis, 1, pOutput, pPhase, nSamples, dAmp);
+	}
+
+	void Oscillator::next(STYPE* pOutput, const int nSamples, const FTYPE dAmp)
+	{
+		STYPE dPhases[MaxBlockSamples];
+		assert(nSamples <= MaxBlockSamples);
+		tick(dPhases, nSamples);
+		shape(pOutput, dPhases, nSamples, dAmp);
+	}
 
 	//////////////////////////////////////////////////////////////////////////////
 	// Envelopes
@@ -92,6 +464,11 @@ namespace Synth
 	//struct Envelope { virtual FTYPE amplitude(const FTYPE dTime, const FTYPE dTimeOn, const FTYPE dTimeOff) const = 0;};
 	//struct EnvelopeADSR : public Envelope
 
+	namespace
+	{
+		constexpr FTYPE EnvelopeFloor = 0.01;	// Amplitudes at or below this are silent
+	}
+
 	FTYPE Envelope::amplitude(const FTYPE dTime, const FTYPE dTimeOn, const FTYPE dTimeOff) const
 	{
 		FTYPE dAmplitude = 0.0;
@@ -127,17 +504,140 @@ namespace Synth
 		}
 
 		// Amplitude should not be negative
-		if (dAmplitude <= 0.01)
+		if (dAmplitude <= EnvelopeFloor)
 			dAmplitude = 0.0;
 
 		return dAmplitude;
 	}
 
+	FTYPE Envelope::amplitude(const uint64_t nSample, const Note& note) const
+	{
+		// Measured from the note on, so the result does not depend on how long the clock has been running
+		const FTYPE dTime = sampleToTime(nSample - note.on);
+		const FTYPE dTimeOff = note.held() ? -1.0 : sampleToTime(note.off - note.on);
+		return amplitude(dTime, 0.0, dTimeOff);
+	}
+
+	void EnvelopeGenerator::enter(const Envelope& env, const Note& note, const uint64_t nLife)
+	{
+		// Stage lengths in samples. Like amplitude(), the attack includes the
+		// sample that lands exactly on its end, and so does the decay.
+		const FTYPE dAttack = env.dAttackTime * g_dSampleRate;
+		const FTYPE dDecay = env.dDecayTime * g_dSampleRate;
+		const FTYPE dRelease = env.dReleaseTime * g_dSampleRate;
+		const auto stageEnd = [](const FTYPE dSamples) { return dSamples > 0.0 ? static_cast<uint64_t>(dSamples) + 1 : 0; };
+		const uint64_t nAttackEnd = stageEnd(dAttack);
+		const uint64_t nDecayEnd = stageEnd(dAttack + dDecay);
+
+		// A released note starts its release from wherever the held envelope was at the note off
+		const uint64_t nOff = note.off - note.on;
+		const bool bReleased = !note.held() && nOff <= nLife;
+		const uint64_t nHeld = bReleased ? nOff : nLife;
+
+		m_nOn = note.on;
+		if (nHeld < nAttackEnd)
+		{
+			m_nStage = STAGE_ATTACK;
+			m_dSlope = env.dStartAmplitude / dAttack;
+			m_dBase = 0.0;
+			m_nEnd = nAttackEnd;
+		}
+		else if (nHeld < nDecayEnd)
+		{
+			m_nStage = STAGE_DECAY;
+			m_dSlope = (env.dSustainAmplitude - env.dStartAmplitude) / dDecay;
+			m_dBase = env.dStartAmplitude - m_dSlope * dAttack;
+			m_nEnd = nDecayEnd;
+		}
+		else
+		{
+			m_nStage = (env.dSustainAmplitude > EnvelopeFloor) ? STAGE_SUSTAIN : STAGE_DONE;
+			m_dSlope = 0.0;
+			m_dBase = env.dSustainAmplitude;
+			m_nEnd = UINT64_MAX;
+		}
+		if (!bReleased || m_nStage == STAGE_DONE)
+			return;
+
+		// The release ends on the first sample at or below the floor
+		const FTYPE dFrom = m_dBase + m_dSlope * static_cast<FTYPE>(nHeld);
+		const uint64_t nEnd = (dFrom > EnvelopeFloor && dRelease > 0.0) ? nOff + static_cast<uint64_t>(ceil(dRelease * (1.0 - EnvelopeFloor / dFrom))) : 0;
+		if (nLife < nEnd)
+		{
+			m_nStage = STAGE_RELEASE;
+			m_dSlope = -dFrom / dRelease;
+			m_dBase = dFrom - m_dSlope * static_cast<FTYPE>(nOff);
+			m_nEnd = nEnd;
+		}
+		else
+		{
+			m_nStage = STAGE_DONE;
+			m_dSlope = 0.0;
+			m_dBase = 0.0;
+			m_nEnd = UINT64_MAX;
+		}
+	}
+
+	void EnvelopeGenerator::render(const Envelope& env, STYPE* pOutput, const int nSamples, const uint64_t nSample, const Note& note)
+	{
+		if (nSamples <= 0)
+			return;
+
+		const bool bReleasing = !note.held();
+		const uint64_t nOff = note.off - note.on;
+		uint64_t nLife = nSample - note.on;
+		int n = 0;
+		while (n < nSamples)
+		{
+			if (note.on != m_nOn || nLife >= m_nEnd || (bReleasing && nLife >= nOff && m_nStage < STAGE_RELEASE))
+				enter(env, note, nLife);
+
+			// Run to the end of the block, of the stage or of the held part, whichever comes first
+			uint64_t nRun = std::min<uint64_t>(nSamples - n, m_nEnd - nLife);
+			if (bReleasing && nLife < nOff)
+				nRun = std::min(nRun, nOff - nLife);
+
+			const int nCount = static_cast<int>(nRun);
+			const FTYPE dStart = m_dBase + m_dSlope * static_cast<FTYPE>(nLife);
+			for (int i = 0; i < nCount; ++i)
+			{
+				const FTYPE dAmplitude = dStart + m_dSlope * i;
+				pOutput[n + i] = (dAmplitude <= EnvelopeFloor) ? STYPE(0) : static_cast<STYPE>(dAmplitude);
+			}
+			n += nCount;
+			nLife += nRun;
+		}
+		m_dLevel = pOutput[nSamples - 1];
+	}
+
 	/*static*/ FTYPE env(const FTYPE dTime, const Envelope& envel, const FTYPE dTimeOn, const FTYPE dTimeOff)
 	{
 		return envel.amplitude(dTime, dTimeOn, dTimeOff);
 	}
 
+	void Instrument::renderBlock(const uint64_t nSample, const Note& note, VoiceState& /*state*/, STYPE* pOutput, const int nSamples, bool& bNoteFinished) const
+	{
+		for (int n = 0; n < nSamples; ++n)
+			pOutput[n] = static_cast<STYPE>(sound(sampleToTime(nSample + n), note, bNoteFinished));
+	}
+
+	void Instrument::renderVoices(const uint64_t nSample, VoiceBatch& batch, const int nSamples) const
+	{
+		for (size_t v = 0; v < batch.nVoices; ++v)
+		{
+			bool bNoteFinished = false;
+			renderBlock(nSample, *batch.pNote[v], *batch.pState[v], batch.pOutput[v], nSamples, bNoteFinished);
+			batch.bFinished[v] = bNoteFinished;
+		}
+	}
+
+	FTYPE Instrument::sound(const uint64_t nSample, const Note& note, VoiceState& state, bool& bNoteFinished) const
+	{
+		STYPE dOutput = 0;
+		renderBlock(nSample, note, state, &dOutput, 1, bNoteFinished);
+		return dOutput;
+	}
+
 	Instrument_harmonica::Instrument_harmonica()
 	{
 		envADSR.dAttackTime = 0.00;
@@ -147,25 +647,57 @@ namespace Synth
 		fMaxLifeTime = -1.0;
 		name = "Harmonica";
 		dVolume = 0.3;
+		pSawTable = getWavetable(Synth::OSC_SAW_ANA, 100);
 	}
 
 	FTYPE Instrument_harmonica::sound(const FTYPE dTime, Note note, bool& bNoteFinished) const
 	{
-		FTYPE dAmplitude = Synth::env(dTime, envADSR, note.on, note.off);
+		const FTYPE dTimeOn = sampleToTime(note.on);
+		const FTYPE dTimeOff = sampleToTime(note.off);
+		FTYPE dAmplitude = Synth::env(dTime, envADSR, dTimeOn, dTimeOff);
 		if (dAmplitude <= 0.0)
 			bNoteFinished = true;
 
-		auto t1 = note.on - dTime;
-		auto t2 = dTime - note.on;
+		auto t1 = dTimeOn - dTime;
+		auto t2 = dTime - dTimeOn;
 		FTYPE dSound =
-			+1.00 * Synth::oscillator(t1, Synth::scale(note.id - 12), Synth::OSC_SAW_ANA, 5.0, 0.001, 100)
-			+ 1.00 * Synth::oscillator(t2, Synth::scale(note.id + 00), Synth::OSC_SQUARE, 5.0, 0.001)
-			+ 0.50 * Synth::oscillator(t2, Synth::scale(note.id + 12), Synth::OSC_SQUARE)
-			+ 0.05 * Synth::oscillator(t2, Synth::scale(note.id + 24), Synth::OSC_NOISE);
+			+1.00 * Synth::oscillator(t1, Synth::scale(note.id - 12, nScale), Synth::OSC_SAW_ANA, 5.0, 0.001, 100)
+			+ 1.00 * Synth::oscillator(t2, Synth::scale(note.id + 00, nScale), Synth::OSC_SQUARE, 5.0, 0.001)
+			+ 0.50 * Synth::oscillator(t2, Synth::scale(note.id + 12, nScale), Synth::OSC_SQUARE)
+			+ 0.05 * Synth::oscillator(t2, Synth::scale(note.id + 24, nScale), Synth::OSC_NOISE);
 
 		return dAmplitude * dSound * dVolume;
 	}
 
+	void Instrument_harmonica::renderBlock(const uint64_t nSample, const Note& note, VoiceState& state, STYPE* pOutput, const int nSamples, bool& bNoteFinished) const
+	{
+		assert(nSamples <= MaxBlockSamples);
+		if (!state.bStarted)
+		{
+			state.osc[0].start(Synth::OSC_SAW_ANA, Synth::scale(note.id - 12, nScale), 5.0, 0.001, pSawTable);
+			state.osc[1].start(Synth::OSC_SQUARE, Synth::scale(note.id + 00, nScale), 5.0, 0.001);
+			state.osc[2].start(Synth::OSC_SQUARE, Synth::scale(note.id + 12, nScale));
+			state.osc[3].start(Synth::OSC_NOISE, Synth::scale(note.id + 24, nScale));
+			state.bStarted = true;
+		}
+
+		STYPE dAmplitude[MaxBlockSamples];
+		state.env.render(envADSR, dAmplitude, nSamples, nSample, note);
+		if (state.env.finished())
+			bNoteFinished = true;
+
+		// The saw runs backwards in time in the reference version, which is the same as inverting it
+		STYPE dSound[MaxBlockSamples] = {};
+		state.osc[0].next(dSound, nSamples, -1.00);
+		state.osc[1].next(dSound, nSamples, 1.00);
+		state.osc[2].next(dSound, nSamples, 0.50);
+		state.osc[3].next(dSound, nSamples, 0.05);
+
+		const STYPE dGain = static_cast<STYPE>(dVolume);
+		for (int n = 0; n < nSamples; ++n)
+			pOutput[n] = dAmplitude[n] * dSound[n] * dGain;
+	}
+
 	Instrument_drumkick::Instrument_drumkick()
 	{
 		envADSR.dAttackTime = 0.01;
@@ -179,17 +711,43 @@ namespace Synth
 
 	FTYPE Instrument_drumkick::sound(const FTYPE dTime, Note note, bool& bNoteFinished) const
 	{
-		FTYPE dAmplitude = Synth::env(dTime, envADSR, note.on, note.off);
-		if (fMaxLifeTime > 0.0 && dTime - note.on >= fMaxLifeTime)
+		const FTYPE dTimeOn = sampleToTime(note.on);
+		const FTYPE dTimeOff = sampleToTime(note.off);
+		FTYPE dAmplitude = Synth::env(dTime, envADSR, dTimeOn, dTimeOff);
+		if (fMaxLifeTime > 0.0 && dTime - dTimeOn >= fMaxLifeTime)
 			bNoteFinished = true;
 
 		FTYPE dSound =
-			+0.99 * Synth::oscillator(dTime - note.on, Synth::scale(note.id - 36), Synth::OSC_SINE, 1.0, 1.0)
-			+ 0.5 * Synth::oscillator(dTime - note.on, 0, Synth::OSC_NOISE);
+			+0.99 * Synth::oscillator(dTime - dTimeOn, Synth::scale(note.id - 36, nScale), Synth::OSC_SINE, 1.0, 1.0)
+			+ 0.5 * Synth::oscillator(dTime - dTimeOn, 0, Synth::OSC_NOISE);
 
 		return dAmplitude * dSound * dVolume;
 	}
 
+	void Instrument_drumkick::renderBlock(const uint64_t nSample, const Note& note, VoiceState& state, STYPE* pOutput, const int nSamples, bool& bNoteFinished) const
+	{
+		assert(nSamples <= MaxBlockSamples);
+		if (!state.bStarted)
+		{
+			state.osc[0].start(Synth::OSC_SINE, Synth::scale(note.id - 36, nScale), 1.0, 1.0);
+			state.osc[1].start(Synth::OSC_NOISE, 0);
+			state.bStarted = true;
+		}
+
+		STYPE dAmplitude[MaxBlockSamples];
+		state.env.render(envADSR, dAmplitude, nSamples, nSample, note);
+		if (fMaxLifeTime > 0.0 && sampleToTime(nSample + nSamples - 1 - note.on) >= fMaxLifeTime)
+			bNoteFinished = true;
+
+		STYPE dSound[MaxBlockSamples] = {};
+		state.osc[0].next(dSound, nSamples, 0.99);
+		state.osc[1].next(dSound, nSamples, 0.5);
+
+		const STYPE dGain = static_cast<STYPE>(dVolume);
+		for (int n = 0; n < nSamples; ++n)
+			pOutput[n] = dAmplitude[n] * dSound[n] * dGain;
+	}
+
 	Instrument_drumsnare::Instrument_drumsnare()
 	{
 		envADSR.dAttackTime = 0.0;
@@ -203,17 +761,43 @@ namespace Synth
 
 	FTYPE Instrument_drumsnare::sound(const FTYPE dTime, Note note, bool& bNoteFinished) const
 	{
-		FTYPE dAmplitude = Synth::env(dTime, envADSR, note.on, note.off);
-		if (fMaxLifeTime > 0.0 && dTime - note.on >= fMaxLifeTime)
+		const FTYPE dTimeOn = sampleToTime(note.on);
+		const FTYPE dTimeOff = sampleToTime(note.off);
+		FTYPE dAmplitude = Synth::env(dTime, envADSR, dTimeOn, dTimeOff);
+		if (fMaxLifeTime > 0.0 && dTime - dTimeOn >= fMaxLifeTime)
 			bNoteFinished = true;
 
 		FTYPE dSound =
-			+0.5 * Synth::oscillator(dTime - note.on, Synth::scale(note.id - 24), Synth::OSC_SINE, 0.5, 1.0)
-			+ 0.5 * Synth::oscillator(dTime - note.on, 0, Synth::OSC_NOISE);
+			+0.5 * Synth::oscillator(dTime - dTimeOn, Synth::scale(note.id - 24, nScale), Synth::OSC_SINE, 0.5, 1.0)
+			+ 0.5 * Synth::oscillator(dTime - dTimeOn, 0, Synth::OSC_NOISE);
 
 		return dAmplitude * dSound * dVolume;
 	}
 
+	void Instrument_drumsnare::renderBlock(const uint64_t nSample, const Note& note, VoiceState& state, STYPE* pOutput, const int nSamples, bool& bNoteFinished) const
+	{
+		assert(nSamples <= MaxBlockSamples);
+		if (!state.bStarted)
+		{
+			state.osc[0].start(Synth::OSC_SINE, Synth::scale(note.id - 24, nScale), 0.5, 1.0);
+			state.osc[1].start(Synth::OSC_NOISE, 0);
+			state.bStarted = true;
+		}
+
+		STYPE dAmplitude[MaxBlockSamples];
+		state.env.render(envADSR, dAmplitude, nSamples, nSample, note);
+		if (fMaxLifeTime > 0.0 && sampleToTime(nSample + nSamples - 1 - note.on) >= fMaxLifeTime)
+			bNoteFinished = true;
+
+		STYPE dSound[MaxBlockSamples] = {};
+		state.osc[0].next(dSound, nSamples, 0.5);
+		state.osc[1].next(dSound, nSamples, 0.5);
+
+		const STYPE dGain = static_cast<STYPE>(dVolume);
+		for (int n = 0; n < nSamples; ++n)
+			pOutput[n] = dAmplitude[n] * dSound[n] * dGain;
+	}
+
 	Instrument_drumhihat::Instrument_drumhihat()
 	{
 		envADSR.dAttackTime = 0.01;
@@ -227,17 +811,43 @@ namespace Synth
 
 	FTYPE Instrument_drumhihat::sound(const FTYPE dTime, Note note, bool& bNoteFinished) const
 	{
-		FTYPE dAmplitude = Synth::env(dTime, envADSR, note.on, note.off);
-		if (fMaxLifeTime > 0.0 && dTime - note.on >= fMaxLifeTime)
+		const FTYPE dTimeOn = sampleToTime(note.on);
+		const FTYPE dTimeOff = sampleToTime(note.off);
+		FTYPE dAmplitude = Synth::env(dTime, envADSR, dTimeOn, dTimeOff);
+		if (fMaxLifeTime > 0.0 && dTime - dTimeOn >= fMaxLifeTime)
 			bNoteFinished = true;
 
 		FTYPE dSound =
-			+0.1 * Synth::oscillator(dTime - note.on, Synth::scale(note.id - 12), Synth::OSC_SQUARE, 1.5, 1)
-			+ 0.9 * Synth::oscillator(dTime - note.on, 0, Synth::OSC_NOISE);
+			+0.1 * Synth::oscillator(dTime - dTimeOn, Synth::scale(note.id - 12, nScale), Synth::OSC_SQUARE, 1.5, 1)
+			+ 0.9 * Synth::oscillator(dTime - dTimeOn, 0, Synth::OSC_NOISE);
 
 		return dAmplitude * dSound * dVolume;
 	}
 
+	void Instrument_drumhihat::renderBlock(const uint64_t nSample, const Note& note, VoiceState& state, STYPE* pOutput, const int nSamples, bool& bNoteFinished) const
+	{
+		assert(nSamples <= MaxBlockSamples);
+		if (!state.bStarted)
+		{
+			state.osc[0].start(Synth::OSC_SQUARE, Synth::scale(note.id - 12, nScale), 1.5, 1);
+			state.osc[1].start(Synth::OSC_NOISE, 0);
+			state.bStarted = true;
+		}
+
+		STYPE dAmplitude[MaxBlockSamples];
+		state.env.render(envADSR, dAmplitude, nSamples, nSample, note);
+		if (fMaxLifeTime > 0.0 && sampleToTime(nSample + nSamples - 1 - note.on) >= fMaxLifeTime)
+			bNoteFinished = true;
+
+		STYPE dSound[MaxBlockSamples] = {};
+		state.osc[0].next(dSound, nSamples, 0.1);
+		state.osc[1].next(dSound, nSamples, 0.9);
+
+		const STYPE dGain = static_cast<STYPE>(dVolume);
+		for (int n = 0; n < nSamples; ++n)
+			pOutput[n] = dAmplitude[n] * dSound[n] * dGain;
+	}
+
 	Sequencer::Sequencer(float tempo, int beats, int subbeats)
 	{
 		nBeats = beats;
@@ -246,17 +856,25 @@ namespace Synth
 		fBeatTime = (60.0f / fTempo) / (float)nSubBeats;
 		nCurrentBeat = 0;
 		nTotalBeats = nSubBeats * nBeats;
-		fAccumulate = 0;
+		dNextBeatSample = 0;
 	}
 
-	void Sequencer::Update(FTYPE fElapsedTime)
+	void Sequencer::Update(const uint64_t nUntilSample)
 	{
 		vecNotes.clear();
 
-		fAccumulate += fElapsedTime;
-		while (fAccumulate >= fBeatTime)
+		const FTYPE dBeatSamples = fBeatTime * sampleRate();
+		const FTYPE dUntilSample = static_cast<FTYPE>(nUntilSample);
+		if (!bStarted)
+		{
+			dNextBeatSample = dUntilSample + dBeatSamples;
+			bStarted = true;
+		}
+
+		while (dNextBeatSample < dUntilSample)
 		{
-			fAccumulate -= fBeatTime;
+			const uint64_t nBeatSample = static_cast<uint64_t>(dNextBeatSample + 0.5);
+			dNextBeatSample += dBeatSamples;
 			++nCurrentBeat;
 
 			if (nCurrentBeat >= nTotalBeats)
@@ -274,8 +892,9 @@ namespace Synth
 					note.active = true;
 					note.id = BaseNoteID;
 					note.velocity = currentBeatVol / 6.0f;
-					//vecNotes.emplace_back(note, vecChannel[channel].instrument);
-					vecNotes.emplace_back(note, v.instrument);
+					note.priority = v.nPriority;
+					//vecNotes.emplace_back(nBeatSample, note, vecChannel[channel].instrument);
+					vecNotes.emplace_back(nBeatSample, note, v.instrument);
 				}
 				++channel;
 			}
@@ -304,6 +923,10 @@ namespace Synth
 			return OSC_SAW_DIG;
 		if (str == "Noise")
 			return OSC_NOISE;
+		if (str == "Pink")
+			return OSC_NOISE_PINK;
+		if (str == "Brown")
+			return OSC_NOISE_BROWN;
 
 		assert(false);
 		return OSC_SINE;
@@ -325,6 +948,10 @@ namespace Synth
 			return "SawD";
 		case OSC_NOISE:
 			return "Noise";
+		case OSC_NOISE_PINK:
+			return "Pink";
+		case OSC_NOISE_BROWN:
+			return "Brown";
 		}
 
 		assert(false);
@@ -356,44 +983,163 @@ namespace Synth
 		return "";
 	}
 
+	namespace
+	{
+		constexpr FTYPE InaudibleGain = 0.001;
+	}
+
+	bool CustomInstrument::compile()
+	{
+		program.clear();
+		gains.clear();
+		for (const auto& s : sounds)
+		{
+			// The harmonic weights only depend on the sound, not on the note
+			std::vector<FTYPE> vHarmonicAmps;
+			auto amp = s.amp;
+			const auto decay = (s.decayType == EXPONENTIAL) ? s.decay / 100.0f : s.decay;
+			const auto evenOddBal = s.evenOddBal / 100.0f;
+			for (auto h = 0; h < s.harmonics; ++h)
+			{
+				if (s.decayType == EXPONENTIAL)
+					amp *= decay;
+				else
+					amp -= decay;
+				if (amp < InaudibleGain)
+					break;
+				if (h % 2 == 0)
+					amp *= evenOddBal;
+				else
+					amp *= (1 - evenOddBal);
+				vHarmonicAmps.push_back(amp);
+			}
+
+			Step step;
+			step.pWavetable = getWavetable(s.type, s.custom);
+			// Oscillator::start() only sets an LFO depth when LAmp is non-zero
+			step.pKernel = &oscillatorKernel(s.type, s.lAmp != 0.0, step.pWavetable != nullptr);
+			step.nType = s.type;
+			step.nNoteOffset = -s.freq;
+			step.dLFOHertz = s.lFreq;
+			step.dLFOAmplitude = s.lAmp;
+			step.dCustom = s.custom;
+			step.nFirstGain = static_cast<int>(gains.size());
+
+			// The harmonics play the same wave as the sound, so they add up to a
+			// single gain. Noise is the exception, each harmonic draws its own.
+			if (s.type == OSC_NOISE || s.type == OSC_NOISE_PINK || s.type == OSC_NOISE_BROWN)
+			{
+				gains.push_back(s.amp);
+				gains.insert(gains.end(), vHarmonicAmps.begin(), vHarmonicAmps.end());
+			}
+			else
+			{
+				FTYPE dGain = s.amp;
+				for (const auto a : vHarmonicAmps)
+					dGain += a;
+				if (fabs(dGain) < InaudibleGain)
+					continue;
+				gains.push_back(dGain);
+			}
+			step.nGains = static_cast<int>(gains.size()) - step.nFirstGain;
+			program.push_back(step);
+		}
+
+		// A voice only has room for MaxVoiceOscillators, the rest are dropped
+		if (program.size() <= MaxVoiceOscillators)
+			return true;
+		gains.resize(program[MaxVoiceOscillators].nFirstGain);
+		program.resize(MaxVoiceOscillators);
+		return false;
+	}
+
 	CustomInstrument::CustomInstrument()
 	{
 	}
 	FTYPE CustomInstrument::sound(const FTYPE dTime, Note note, bool& bNoteFinished) const
 	{
-		FTYPE dAmplitude = Synth::env(dTime, envADSR, note.on, note.off);
+		const FTYPE dTimeOn = sampleToTime(note.on);
+		const FTYPE dTimeOff = sampleToTime(note.off);
+		FTYPE dAmplitude = Synth::env(dTime, envADSR, dTimeOn, dTimeOff);
 		if (dAmplitude <= 0.0)
 			bNoteFinished = true;
 
-		//auto t1 = note.on - dTime;
-		auto t2 = dTime - note.on;
+		//auto t1 = dTimeOn - dTime;
+		auto t2 = dTime - dTimeOn;
 		FTYPE dSound = 0.0;
-		for (auto& s : sounds)
+		for (const auto& step : program)
+		{
+			const FTYPE dHertz = Synth::scale(note.id + step.nNoteOffset, nScale);
+			for (int g = 0; g < step.nGains; ++g)
+				dSound += gains[step.nFirstGain + g] * Synth::oscillator(t2, dHertz, step.nType, step.dLFOHertz, step.dLFOAmplitude, step.dCustom);
+		}
+
+		return dAmplitude * dSound * dVolume;
+	}
+
+	void CustomInstrument::renderBlock(const uint64_t nSample, const Note& note, VoiceState& state, STYPE* pOutput, const int nSamples, bool& bNoteFinished) const
+	{
+		VoiceBatch batch;
+		batch.nVoices = 1;
+		batch.pNote[0] = &note;
+		batch.pState[0] = &state;
+		batch.pOutput[0] = pOutput;
+		renderVoices(nSample, batch, nSamples);
+		if (batch.bFinished[0])
+			bNoteFinished = true;
+	}
+
+	void CustomInstrument::renderVoices(const uint64_t nSample, VoiceBatch& batch, const int nSamples) const
+	{
+		assert(nSamples <= MaxBlockSamples);
+		assert(batch.nVoices <= MaxBatchVoices);
+		assert(program.size() <= MaxVoiceOscillators);
+		const size_t nVoices = batch.nVoices;
+		for (size_t v = 0; v < nVoices; ++v)
 		{
-			dSound += s.amp * Synth::oscillator(t2, Synth::scale(note.id - s.freq), s.type, s.lFreq, s.lAmp, s.custom);
-			if (s.harmonics > 0)
+			VoiceState& state = *batch.pState[v];
+			if (!state.bStarted)
 			{
-				auto amp = s.amp;
-				const auto decay = (s.decayType == EXPONENTIAL) ? s.decay / 100.0f : s.decay;
-				const auto evenOddBal = s.evenOddBal / 100.0f;
-				for (auto h = 0; h < s.harmonics; ++h)
+				for (size_t i = 0; i < program.size(); ++i)
 				{
-					if (s.decayType == EXPONENTIAL)
-						amp *= decay;
-					else
-						amp -= decay;
-					if (amp < 0.001)
-						break;
-					if (h % 2 == 0)
-						amp *= evenOddBal;
-					else
-						amp *= (1 - evenOddBal);
-					dSound += amp * Synth::oscillator(t2, Synth::scale(note.id - s.freq), s.type, s.lFreq, s.lAmp, s.custom);
+					const auto& step = program[i];
+					state.osc[i].start(step.nType, Synth::scale(batch.pNote[v]->id + step.nNoteOffset, nScale), step.dLFOHertz, step.dLFOAmplitude, step.pWavetable);
 				}
+				state.bStarted = true;
 			}
 		}
 
-		return dAmplitude * dSound * dVolume;
+		// Each step runs for the whole batch at once. The voices' phases and
+		// sound are interleaved, [sample][voice], so the phases advance in one
+		// pass across the voices and each computed wave is a single kernel call.
+		// Only the envelope multiply at the end takes the voices apart again.
+		const int nValues = nSamples * static_cast<int>(nVoices);
+		alignas(64) STYPE dSound[MaxBlockSamples * MaxBatchVoices];
+		alignas(64) STYPE dPhase[MaxBlockSamples * MaxBatchVoices];
+		std::fill_n(dSound, nValues, STYPE(0));
+		Oscillator* pOscillators[MaxBatchVoices];
+		for (size_t i = 0; i < program.size(); ++i)
+		{
+			const auto& step = program[i];
+			for (size_t v = 0; v < nVoices; ++v)
+				pOscillators[v] = &batch.pState[v]->osc[i];
+
+			// The harmonics share the frequency of the sound, so they also share its phase
+			step.pKernel->tick(pOscillators, nVoices, dPhase, nSamples);
+			for (int g = 0; g < step.nGains; ++g)
+				step.pKernel->shape(pOscillators, nVoices, dSound, dPhase, nSamples, gains[step.nFirstGain + g]);
+		}
+
+		const STYPE dGain = static_cast<STYPE>(dVolume);
+		for (size_t v = 0; v < nVoices; ++v)
+		{
+			VoiceState& state = *batch.pState[v];
+			STYPE* pOutput = batch.pOutput[v];
+			state.env.render(envADSR, pOutput, nSamples, nSample, *batch.pNote[v]);
+			batch.bFinished[v] = state.env.finished();
+			for (int n = 0; n < nSamples; ++n)
+				pOutput[n] = pOutput[n] * dSound[n * nVoices + v] * dGain;
+		}
 	}
 
 	std::vector<CustomInstrument> loadInstruments()
@@ -418,6 +1164,12 @@ namespace Synth
 			ci.envADSR.dReleaseTime = instJ["R"];
 			ci.fMaxLifeTime = instJ["MaxLife"];
 			ci.dVolume = instJ["Amp"];
+			if (instJ.contains("ControlSamples"))
+				ci.nControlSamples = std::max(instJ["ControlSamples"].get<int>(), 1);
+			if (instJ.contains("Pan"))
+				ci.dPan = std::clamp(instJ["Pan"].get<FTYPE>(), -1.0, 1.0);
+			if (instJ.contains("Spread"))
+				ci.dSpread = instJ["Spread"].get<FTYPE>();
 
 			auto sounds = instJ["Sounds"];
 			for (auto s : sounds)
@@ -432,6 +1184,8 @@ namespace Synth
 					sound.lFreq = s["LFreq"];
 				if (s.contains("LAmp"))
 					sound.lAmp = s["LAmp"];
+				if (s.contains("Cust"))
+					sound.custom = s["Cust"];
 				if (s.contains("Harmonics"))
 					sound.harmonics = s["Harmonics"];
 				if (s.contains("DecayType"))
@@ -443,8 +1197,87 @@ namespace Synth
 
 				ci.sounds.push_back(sound);
 			}
+			if (!ci.compile())
+			{
+				std::cerr << "Instrument " << ci.name << ": more than " << MaxVoiceOscillators << " audible sounds, not loaded" << '\n';
+				continue;
+			}
 			instruments.push_back(ci);
 		}
 		return instruments;
 	}
+
+	std::vector<int> patternToBeats(const std::string_view sPattern)
+	{
+		std::vector<int> ar;
+		ar.reserve(sPattern.size());
+		auto intForChar = [](const char ch)
+		{
+			switch (ch)
+			{
+			case '_':
+				return 2;
+			case '-':
+				return 4;
+			case '^':
+				return 6;
+			case '#':
+				return 8;
+			}
+			return 0;
+		};
+
+		for (auto ch : sPattern)
+			ar.push_back(intForChar(ch));
+		return ar;
+	}
+
+	bool loadSong(const std::string& sFileName, const std::vector<Instrument*>& instruments, Sequencer& sequencer)
+	{
+		json::json jSong;
+		{
+			std::ifstream i(sFileName);
+			if (!i)
+			{
+				std::cerr << "Song " << sFileName << ": cannot open" << '\n';
+				return false;
+			}
+			try
+			{
+				i >> jSong;
+			}
+			catch (const json::json::exception& e)
+			{
+				std::cerr << "Song " << sFileName << ": " << e.what() << '\n';
+				return false;
+			}
+		}
+
+		try
+		{
+			sequencer = Sequencer(jSong.at("Tempo"), jSong.at("Beats"), jSong.at("SubBeats"));
+			for (auto& channelJ : jSong.at("Channels"))
+			{
+				const std::string sName = channelJ.at("Instrument").get<std::string>();
+				auto inst = std::find_if(instruments.begin(), instruments.end(), [&](const Instrument* p) { return p->name == sName; });
+				if (inst == instruments.end())
+				{
+					std::cerr << "Song " << sFileName << ": unknown instrument " << sName << '\n';
+					continue;
+				}
+
+				auto& channel = sequencer.vecChannel[sequencer.AddInstrument(*inst)];
+				channel.sBeat = patternToBeats(channelJ.at("Pattern").get<std::string>());
+				channel.sBeat.resize(sequencer.nTotalBeats, 0);
+				if (channelJ.contains("Priority"))
+					channel.nPriority = channelJ["Priority"];
+			}
+		}
+		catch (const json::json::exception& e)
+		{
+			std::cerr << "Song " << sFileName << ": " << e.what() << '\n';
+			return false;
+		}
+		return true;
+	}
 }
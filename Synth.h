@@ -1,13 +1,25 @@
 #pragma once
 
+#include <array>
+#include <cstdint>
 #include <string>
 #include <string_view>
 #include <vector>
 
+#include "Noise.h"
+
 #ifndef FTYPE
 #define FTYPE double
 #endif
 
+// Type of the audio sample buffers. Parameters, times and oscillator phases
+// stay in FTYPE, so notes keep their pitch over long renders; defining STYPE
+// as float halves the memory the render path streams through and doubles the
+// samples in each SIMD register.
+#ifndef STYPE
+#define STYPE double
+#endif
+
 namespace Synth
 {
 	enum WaveType
@@ -18,6 +30,8 @@ namespace Synth
 		, OSC_SAW_ANA
 		, OSC_SAW_DIG
 		, OSC_NOISE
+		, OSC_NOISE_PINK
+		, OSC_NOISE_BROWN
 	};
 	enum HarmonicDecayType
 	{
@@ -38,12 +52,74 @@ namespace Synth
 	FTYPE oscillator(const FTYPE dTime, const FTYPE dHertz, const WaveType nType, const FTYPE dLFOHertz, const FTYPE dLFOAmplitude);
 	FTYPE oscillator(const FTYPE dTime, const FTYPE dHertz, const WaveType nType, const FTYPE dLFOHertz, const FTYPE dLFOAmplitude, FTYPE dCustom);
 
+	// Sample rate used to derive per-sample phase increments
+	void setSampleRate(const FTYPE dSampleRate);
+	FTYPE sampleRate();
+
+	// Converts a sample clock time to seconds
+	FTYPE sampleToTime(const uint64_t nSample);
+
+	// Evaluates one cycle of a waveform at dPhase, which is in cycles [0, 1)
+	FTYPE waveform(const WaveType nType, const FTYPE dPhase, const FTYPE dCustom = 50);
+
+	class Wavetable;
+
+	// Phase accumulator oscillator. Unlike oscillator() above, which evaluates
+	// the waveform from the absolute time, this keeps a wrapped phase per voice
+	// and advances it by a fixed increment each sample, so there is no drift
+	// however long the note (or the program) has been running.
+	struct Oscillator
+	{
+		WaveType nType = OSC_SINE;
+		const STYPE* pTable = nullptr;	// Band-limited table chosen for this note's frequency, if any
+		FTYPE dPhase = 0.0;			// Current phase, in cycles [0, 1)
+		FTYPE dPhaseInc = 0.0;		// Phase advance per sample
+		FTYPE dLFOPhase = 0.0;
+		FTYPE dLFOPhaseInc = 0.0;
+		FTYPE dLFODepth = 0.0;		// Peak phase deviation caused by the LFO, in cycles
+		int nLFOInterval = 1;		// Samples between LFO evaluations in the block tick(), interpolated in between. Not reset by start()
+		NoiseGenerator noise;		// Source for the noise waveforms, not reset by start()
+
+		void start(const WaveType nWaveType, const FTYPE dHertz, const FTYPE dLFOHertz = 0.0, const FTYPE dLFOAmplitude = 0.0, const Wavetable* pWavetable = nullptr);
+
+		// Returns the current (LFO modulated) phase and advances by one sample
+		FTYPE tick();
+		// Evaluates this oscillator's waveform at dAtPhase. Square, triangle and
+		// digital saw are anti-aliased with PolyBLEP/PolyBLAMP. Noise ignores
+		// the phase and draws from the oscillator's own generator.
+		FTYPE shape(const FTYPE dAtPhase);
+		FTYPE next() { return shape(tick()); }
+
+		// Block versions of the above. shape() and next() add dAmp times the waveform to pOutput.
+		void tick(STYPE* pPhase, const int nSamples);
+		void shape(STYPE* pOutput, const STYPE* pPhase, const int nSamples, const FTYPE dAmp);
+		void next(STYPE* pOutput, const int nSamples, const FTYPE dAmp);
+	};
+
+	// Oscillator::tick() and shape() for blocks, compiled once per waveform and
+	// for with and without an LFO, so the inner loops have no branches on them.
+	// Instruments whose waveforms are fixed look the kernel up once at load time.
+	// Each runs nLanes oscillators of the same waveform side by side, up to
+	// MaxBatchVoices, such as one step of a patch for every voice playing it.
+	// Their phases and output are interleaved: pPhase[n * nLanes + v] is sample
+	// n of pOscillators[v]. One lane is the plain block layout.
+	struct OscillatorKernel
+	{
+		void (*tick)(Oscillator* const* pOscillators, const size_t nLanes, STYPE* pPhase, const int nSamples);
+		void (*shape)(Oscillator* const* pOscillators, const size_t nLanes, STYPE* pOutput, const STYPE* pPhase, const int nSamples, const FTYPE dAmp);
+	};
+
+	// bTable selects the kernel that reads from the oscillator's wavetable, whatever nType is
+	const OscillatorKernel& oscillatorKernel(const WaveType nType, const bool bLFO, const bool bTable);
+
 	//////////////////////////////////////////////////////////////////////////////
 	// Scale to Frequency conversion
 
-	constexpr int SCALE_DEFAULT = 0;
+	constexpr int SCALE_DEFAULT = 0;	// 12 tone equal temperament, note 0 is 8Hz
 
-	FTYPE scale(const int nNoteID, const int /*nScaleID*/ = SCALE_DEFAULT);
+	// Frequency of nNoteID in the tuning nScaleID, a table lookup.
+	// Other tunings are added with loadTuning(), see Tuning.h.
+	FTYPE scale(const int nNoteID, const int nScaleID = SCALE_DEFAULT);
 
 
 	//////////////////////////////////////////////////////////////////////////////
@@ -52,6 +128,8 @@ namespace Synth
 	//struct Envelope { virtual FTYPE amplitude(const FTYPE dTime, const FTYPE dTimeOn, const FTYPE dTimeOff) const = 0;};
 	//struct EnvelopeADSR : public Envelope
 
+	struct Note;
+
 	struct Envelope
 	{
 		FTYPE dAttackTime = 0;
@@ -61,6 +139,39 @@ namespace Synth
 		FTYPE dStartAmplitude = 1.0;
 
 		FTYPE amplitude(const FTYPE dTime, const FTYPE dTimeOn, const FTYPE dTimeOff) const;
+
+		// Sample clock version, only times relative to the note on are converted to seconds
+		FTYPE amplitude(const uint64_t nSample, const Note& note) const;
+	};
+
+	// Incremental version of Envelope::amplitude() for one voice. Each stage is
+	// a straight line in samples since the note on, worked out once when the
+	// stage is entered, so rendering costs a multiply-add per sample. It
+	// follows note.on and note.off itself, so retriggers and releases land on
+	// their exact sample.
+	class EnvelopeGenerator
+	{
+	public:
+		// Fills pOutput with the amplitude for nSamples, the first at sample clock time nSample
+		void render(const Envelope& env, STYPE* pOutput, const int nSamples, const uint64_t nSample, const Note& note);
+
+		// True once the envelope has gone silent for good (until a retrigger)
+		bool finished() const { return m_nStage == STAGE_DONE; }
+		// The last amplitude rendered
+		FTYPE level() const { return m_dLevel; }
+
+	private:
+		enum Stage { STAGE_ATTACK, STAGE_DECAY, STAGE_SUSTAIN, STAGE_RELEASE, STAGE_DONE };
+
+		// Sets up the stage that nLife samples after the note on falls in
+		void enter(const Envelope& env, const Note& note, const uint64_t nLife);
+
+		Stage m_nStage = STAGE_DONE;
+		uint64_t m_nOn = UINT64_MAX;	// note.on of the note being followed
+		uint64_t m_nEnd = 0;			// Samples after the note on at which this stage ends
+		FTYPE m_dBase = 0.0;			// The amplitude is m_dBase + m_dSlope * samples since the note on
+		FTYPE m_dSlope = 0.0;
+		FTYPE m_dLevel = 0.0;
 	};
 
 	FTYPE env(const FTYPE dTime, const Envelope& envel, const FTYPE dTimeOn, const FTYPE dTimeOff);
@@ -70,10 +181,48 @@ namespace Synth
 	struct Note
 	{
 		int id = 0;		// Position in scale
-		FTYPE on = 0;	// Time note was activated
-		FTYPE off = 0;	// Time note was deactivated
+		uint64_t on = 0;	// Sample clock time note was activated
+		uint64_t off = 0;	// Sample clock time note was deactivated
 		FTYPE velocity = 1.0; // how lound is this note, relative to the base loudness of the instrument
+		int priority = 0; // when voices run out, lower priority notes are stolen first
 		bool active = false;
+
+		// The clock starts at 0, so a note that has never been released can have off == on
+		bool held() const { return off < on || off == 0; }
+	};
+
+	// Largest block passed to Instrument::renderBlock()
+	constexpr int MaxBlockSamples = 256;
+
+	// Modulation such as the LFOs runs at a control rate, once every this many samples
+	constexpr int DefaultControlSamples = 32;
+
+	// Render state owned by a single playing voice
+	constexpr size_t MaxVoiceOscillators = 16;
+	struct VoiceState
+	{
+		std::array<Oscillator, MaxVoiceOscillators> osc;
+		EnvelopeGenerator env;
+		bool bStarted = false;
+
+		// Set when the voice has been stolen for another note and is fading out
+		bool bStolen = false;
+		FTYPE dFadeGain = 1.0;
+		FTYPE dFadeStep = 0.0;
+
+		// Left and right gains for stereo output, from Instrument::dPan and dSpread
+		FTYPE dPanGain[2] = { 1.0, 1.0 };
+	};
+
+	// Voices of one instrument that are rendered together, see Instrument::renderVoices()
+	constexpr size_t MaxBatchVoices = 8;
+	struct VoiceBatch
+	{
+		size_t nVoices = 0;
+		const Note* pNote[MaxBatchVoices] = {};
+		VoiceState* pState[MaxBatchVoices] = {};
+		STYPE* pOutput[MaxBatchVoices] = {};
+		bool bFinished[MaxBatchVoices] = {};
 	};
 
 	struct Instrument
@@ -82,13 +231,41 @@ namespace Synth
 		Envelope envADSR;
 		FTYPE fMaxLifeTime;
 		std::string name;
+		int nScale = SCALE_DEFAULT;	// Tuning the notes are played in, see scale()
+		int nControlSamples = DefaultControlSamples;	// Samples between LFO evaluations, see Oscillator::nLFOInterval
+		FTYPE dPan = 0.0;		// Stereo position, -1.0 (left) to +1.0 (right)
+		FTYPE dSpread = 0.0;	// How far right each note pans per octave above BaseNoteID
+
+		// Stateless reference implementation, evaluated from the absolute time
 		virtual FTYPE sound(const FTYPE dTime, Note note, bool& bNoteFinished) const = 0;
+
+		// Fills pOutput with nSamples (at most MaxBlockSamples) of this note, the first at
+		// sample clock time nSample, advancing the oscillators in state.
+		// The default implementation calls the reference sound() for each sample.
+		virtual void renderBlock(const uint64_t nSample, const Note& note, VoiceState& state, STYPE* pOutput, const int nSamples, bool& bNoteFinished) const;
+
+		// Renders every voice in batch, which all play this instrument, into their
+		// pOutput. The default calls renderBlock() for each of them; instruments
+		// override it to share the work between the voices.
+		virtual void renderVoices(const uint64_t nSample, VoiceBatch& batch, const int nSamples) const;
+
+		// Single sample adapter over renderBlock()
+		FTYPE sound(const uint64_t nSample, const Note& note, VoiceState& state, bool& bNoteFinished) const;
 	};
 
 	struct NoteInstrumentPtr
 	{
 		Note m_Note;
 		Instrument* m_pInstrument;
+		VoiceState m_State;
+	};
+
+	// A note to start at an exact sample, counted from when the audio started
+	struct ScheduledNote
+	{
+		uint64_t nSample;
+		Note note;
+		Instrument* pInstrument;
 	};
 
 	struct CustomInstrument : public Instrument
@@ -112,21 +289,52 @@ namespace Synth
 			WaveType type;
 			FTYPE lFreq = 0;
 			FTYPE lAmp = 0;
-			FTYPE custom = 0;
+			FTYPE custom = 50;
 			int harmonics = 0;
 			HarmonicDecayType decayType = LINEAR;
 			FTYPE decay = 0;
 			int evenOddBal = 50;
 		};
+
+		// One oscillator of the compiled program. Its wave is played once for
+		// each of its gains, which is once unless it is noise with harmonics.
+		struct Step
+		{
+			const OscillatorKernel* pKernel = nullptr;
+			const Wavetable* pWavetable = nullptr;
+			WaveType nType = OSC_SINE;
+			int nNoteOffset = 0;	// Added to the note ID
+			FTYPE dLFOHertz = 0.0;
+			FTYPE dLFOAmplitude = 0.0;
+			FTYPE dCustom = 50;
+			int nFirstGain = 0;		// Into gains
+			int nGains = 0;
+		};
+
 		CustomInstrument();
 		FTYPE sound(const FTYPE dTime, Note note, bool& bNoteFinished) const override;
+		void renderBlock(const uint64_t nSample, const Note& note, VoiceState& state, STYPE* pOutput, const int nSamples, bool& bNoteFinished) const override;
+		void renderVoices(const uint64_t nSample, VoiceBatch& batch, const int nSamples) const override;
+
+		// Turns sounds into program and gains. Call after changing sounds.
+		// Returns false if more than MaxVoiceOscillators sounds are audible.
+		// The program is then cut to MaxVoiceOscillators steps so it is still
+		// safe to play, but the instrument is not what was asked for, so
+		// loadInstruments() rejects it.
+		bool compile();
+
 		std::vector<Sound> sounds;
+		std::vector<Step> program;
+		std::vector<FTYPE> gains;
 	};
 
 	struct Instrument_harmonica : public Instrument
 	{
 		Instrument_harmonica();
 		FTYPE sound(const FTYPE dTime, Note note, bool& bNoteFinished) const override;
+		void renderBlock(const uint64_t nSample, const Note& note, VoiceState& state, STYPE* pOutput, const int nSamples, bool& bNoteFinished) const override;
+
+		const Wavetable* pSawTable;
 	};
 	/* Currently not in use
 		struct Instrument_bell : public Instrument
@@ -193,12 +401,14 @@ namespace Synth
 	{
 		Instrument_drumkick();
 		FTYPE sound(const FTYPE dTime, Note note, bool& bNoteFinished) const override;
+		void renderBlock(const uint64_t nSample, const Note& note, VoiceState& state, STYPE* pOutput, const int nSamples, bool& bNoteFinished) const override;
 	};
 
 	struct Instrument_drumsnare : public Instrument
 	{
 		Instrument_drumsnare();
 		FTYPE sound(const FTYPE dTime, Note note, bool& bNoteFinished) const override;
+		void renderBlock(const uint64_t nSample, const Note& note, VoiceState& state, STYPE* pOutput, const int nSamples, bool& bNoteFinished) const override;
 	};
 
 
@@ -206,6 +416,7 @@ namespace Synth
 	{
 		Instrument_drumhihat();
 		FTYPE sound(const FTYPE dTime, Note note, bool& bNoteFinished) const override;
+		void renderBlock(const uint64_t nSample, const Note& note, VoiceState& state, STYPE* pOutput, const int nSamples, bool& bNoteFinished) const override;
 	};
 
 
@@ -217,11 +428,15 @@ namespace Synth
 			Instrument* instrument;
 			std::vector<int> sBeat;
 			bool bMuted = false;
+			int nPriority = 0;	// Priority of the notes this channel plays, see Note::priority
 		};
 
 	public:
 		Sequencer(float tempo, int beats, int subbeats);
-		void Update(FTYPE fElapsedTime);
+
+		// Fills vecNotes with the notes of every beat that starts before nUntilSample
+		// on the audio sample clock. The first call starts the sequence there.
+		void Update(const uint64_t nUntilSample);
 
 		/** Returns index of instrument */
 		size_t AddInstrument(Instrument* inst);
@@ -231,14 +446,15 @@ namespace Synth
 		int nSubBeats;
 		FTYPE fTempo;
 		FTYPE fBeatTime;
-		FTYPE fAccumulate;
+		FTYPE dNextBeatSample;	// Not rounded, so the beats do not drift
+		bool bStarted = false;
 		int nCurrentBeat;
 		int nTotalBeats;
 		bool bMuted = false;
 
 	public:
 		std::vector<Channel> vecChannel;
-		std::vector<NoteInstrumentPtr> vecNotes;
+		std::vector<ScheduledNote> vecNotes;
 
 		bool muted() const { return bMuted; }
 		bool muted(const Channel& v) const { return bMuted || v.bMuted; }
@@ -248,5 +464,16 @@ namespace Synth
 
 	};
 
+	// A beat pattern has one character per sub beat: '.' is a rest, and
+	// '_', '-', '^' and '#' are increasingly loud hits
+	std::vector<int> patternToBeats(const std::string_view sPattern);
+
+	// Reads Instruments.json. An instrument with more audible sounds than a
+	// voice has oscillators is left out, with an error.
 	std::vector<CustomInstrument> loadInstruments();
+
+	// Reads a song file with the tempo, the time signature, and a beat pattern
+	// for each channel into sequencer. Channels refer to their instrument by
+	// name. Prints the problem and returns false if the file can't be read.
+	bool loadSong(const std::string& sFileName, const std::vector<Instrument*>& instruments, Sequencer& sequencer);
 }
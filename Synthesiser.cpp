@@ -63,9 +63,15 @@ See video: https://youtu.be/tgamhuQnOkM
 using FTYPE = double;
 #include "olcNoiseMaker.h"
 
+#include "Engine.h"
+#include "OfflineRender.h"
 #include "Synth.h"
+#include "Tuning.h"
 #include "UI.h"
 
+#include <array>
+#include <charconv>
+#include <cstring>
 #include <list>
 #include <iostream>
 #include <algorithm>
@@ -73,62 +79,94 @@ using FTYPE = double;
 
 namespace
 {
-	std::vector<Synth::NoteInstrumentPtr> vecNotes;
-	std::mutex muxNotes;
 	//Synth::Instrument_bell instBell;
 	Synth::Instrument_harmonica instHarm;
 	Synth::Instrument_drumkick instKick;
 	Synth::Instrument_drumsnare instSnare;
 	Synth::Instrument_drumhihat instHiHat;
 
-	typedef bool(*lambda)(const Synth::NoteInstrumentPtr& item);
-	template<class T>
-	void safe_remove(T& v, lambda f)
+	// The engine MakeNoise plays, set before the sound device starts
+	Synth::Engine* pEngine = nullptr;
+
+	// Function used by olcNoiseMaker to generate sound waves
+	// Fills pOutput with nFrames interleaved frames (-1.0 to +1.0), starting at nSample
+	void MakeNoise(STYPE* pOutput, unsigned int nFrames, unsigned int nChannels, uint64_t nSample)
 	{
-		auto n = v.begin();
-		while (n != v.end())
-		{
-			if (!f(*n))
-				n = v.erase(n);
-			else
-				++n;
-		}
+		pEngine->render(pOutput, nFrames, nSample, nChannels);
 	}
 
-	// Function used by olcNoiseMaker to generate sound waves
-	// Returns amplitude (-1.0 to +1.0) as a function of time
-	FTYPE MakeNoise(int /*nChannel*/, FTYPE dTime)
+	// Reads the whole of sText as a number, false if any of it isn't one
+	template <typename T>
+	bool parseNumber(const char* sText, T& nValue)
 	{
-		std::lock_guard  lock(muxNotes);
-		FTYPE dMixedOutput = 0.0;
+		const char* pEnd = sText + std::strlen(sText);
+		const auto [ptr, ec] = std::from_chars(sText, pEnd, nValue);
+		return ec == std::errc() && ptr == pEnd && ptr != sText;
+	}
 
-		// Iterate through all active notes, and mix together
-		for (auto& [n, c] : vecNotes)
-		{
-			bool bNoteFinished = false;
-			FTYPE dSound = 0;
+	// The pattern played when no song is given
+	void addDrumPattern(Synth::Sequencer& sequencer)
+	{
+		auto kick = sequencer.AddInstrument(&instKick);
+		auto snare = sequencer.AddInstrument(&instSnare);
+		auto hh = sequencer.AddInstrument(&instHiHat);
 
-			// Get sample for this note by using the correct instrument and envelope
-			if (c != nullptr)
-				dSound = c->sound(dTime, n, bNoteFinished) * n.velocity;
+		sequencer.vecChannel[kick ].sBeat = Synth::patternToBeats("^...^...^..^.^..");
+		sequencer.vecChannel[snare].sBeat = Synth::patternToBeats("..#...#...#...#.");
+		sequencer.vecChannel[hh   ].sBeat = Synth::patternToBeats("^.-.^.-.^._.^._^");
+	}
 
-			// Mix into output
-			dMixedOutput += dSound;
+	// Renders the song, or the drum pattern if there is no song, to a WAV file
+	// without opening a window or a sound device. Every instrument plays in the
+	// tuning from the Scala file sTuningFile, if there is one.
+	int renderToFile(const std::string& sFileName, const std::string& sSongFile, const std::string& sTuningFile, const FTYPE dSeconds, const unsigned int nChannels, const Synth::WavSampleFormat nFormat, const Synth::ClipType nClip, const bool bDither)
+	{
+		constexpr unsigned int nSampleRate = 44100;
+		Synth::setSampleRate(nSampleRate);
+
+		int nScale = Synth::SCALE_DEFAULT;
+		if (!sTuningFile.empty() && (nScale = Synth::loadTuning(sTuningFile)) < 0)
+			return 1;
+
+		std::vector<Synth::CustomInstrument> customInstruments;
+		std::vector<Synth::Instrument*> instruments = { &instHarm, &instKick, &instSnare, &instHiHat };
+		Synth::Sequencer sequencer(60.0f, 4, 4);
+		if (sSongFile.empty())
+			addDrumPattern(sequencer);
+		else
+		{
+			customInstruments = Synth::loadInstruments();
+			for (auto& ci : customInstruments)
+				instruments.push_back(&ci);
+			if (!Synth::loadSong(sSongFile, instruments, sequencer))
+				return 1;
+		}
+		for (auto pInstrument : instruments)
+			pInstrument->nScale = nScale;
 
-			if (bNoteFinished) // Flag note to be removed
-				n.active = false;
+		Synth::Engine engine(Synth::Engine::DefaultMaxVoices, Synth::STEAL_LOWEST_PRIORITY, std::thread::hardware_concurrency());
+		Synth::OfflineRenderStats stats;
+		const auto nSamples = static_cast<uint64_t>(dSeconds * nSampleRate);
+		if (!Synth::renderOffline(engine, sequencer, sFileName, nSamples, nChannels, nFormat, nClip, bDither, stats))
+		{
+			std::cerr << "Failed to write " << sFileName << std::endl;
+			return 1;
 		}
-		// Remove notes which are now inactive
-		safe_remove(vecNotes, [](const Synth::NoteInstrumentPtr& item) { return item.m_Note.active; });
-		return dMixedOutput * 0.2;
+
+		std::cout << "Rendered " << stats.dAudioSeconds << "s to " << sFileName << " in " << stats.dWallSeconds << "s ("
+			<< stats.dRealTimeFactor << "x real time)" << std::endl;
+		return 0;
 	}
 }
 
 class Synthesiser : public olc::PixelGameEngine
 {
 public:
-	Synthesiser()
-		: sequencer(60.0f, 4, 4)
+	Synthesiser(const Synth::ClipType nClip, const bool bDither)
+		: engine(Synth::Engine::DefaultMaxVoices, Synth::STEAL_LOWEST_PRIORITY, std::thread::hardware_concurrency())
+		, sequencer(60.0f, 4, 4)
+		, m_nClip(nClip)
+		, m_bDither(bDither)
 	{
 		// Name your application
 		sAppName = "Synth";
@@ -145,14 +183,18 @@ private:
 	static constexpr int m_startX = 20;
 	static constexpr int m_startY = 20;
 	static constexpr int m_rowHeight = 13;
+	static constexpr FTYPE dSequencerLookahead = 0.1; // seconds
 
 	double dWallTime = 0.0;
 
 	std::vector<std::string> devices;
 
+	Synth::Engine engine;	// Declared before sound, so it outlives the audio thread
 	olcNoiseMaker<short> sound;
 
 	Synth::Sequencer sequencer;
+	Synth::ClipType m_nClip;
+	bool m_bDither;
 
 	int m_Frames = 0;
 	FTYPE m_Start = 0;
@@ -160,6 +202,10 @@ private:
 	std::vector<Synth::CustomInstrument> customInstruments;
 
 	Synth::Instrument* pKeyboardInstrument;
+	size_t nKeyboardInstrument = 0;
+	int nKeyboardPriority = 1; // Played notes outrank the sequencer's when voices run out
+	std::array<Synth::Instrument*, 16> m_pHeldKeys = {};	// Instrument playing each held key's note, one per key of the keyboard
+	FTYPE dMasterVolume = 0.2;
 
 	std::vector<std::unique_ptr<Window>> m_Windows;
 	std::vector<WLevels*> m_Levels;
@@ -232,48 +278,20 @@ bool Synthesiser::OnUserCreate()
 	devices = olcNoiseMaker<short>::Enumerate();
 
 	// Create sound machine!!
-	if (!sound.Create(devices[0], 44100, 1, 8, 256))
+	constexpr unsigned int nSampleRate = 44100;
+	Synth::setSampleRate(nSampleRate);
+	if (!sound.Create(devices[0], nSampleRate, 2, 8, 512, m_nClip, m_bDither))
 	{
 		std::cerr << "sound.Create failed for device " << devices[0] << std::endl;
 		return false;
 	}
 
 	// Link noise function with sound machine
-	sound.SetUserFunction(MakeNoise);
+	pEngine = &engine;
+	sound.SetUserBlockFunction(MakeNoise);
 
 	// Establish Sequencer
-	auto kick = sequencer.AddInstrument(&instKick);
-	auto snare = sequencer.AddInstrument(&instSnare);
-	auto hh = sequencer.AddInstrument(&instHiHat);
-
-	auto stringToIntArray = [](const std::string_view str)
-	{
-		std::vector<int> ar;
-		ar.reserve(str.size());
-		auto intForChar = [](const char ch)
-		{
-			switch (ch)
-			{
-			case '_':
-				return 2;
-			case '-':
-				return 4;
-			case '^':
-				return 6;
-			case '#':
-				return 8;
-			}
-			return 0;
-		};
-
-		for (auto ch : str)
-			ar.push_back(intForChar(ch));
-		return ar;
-	};
-	
-	sequencer.vecChannel[kick ].sBeat = stringToIntArray("^...^...^..^.^..");
-	sequencer.vecChannel[snare].sBeat = stringToIntArray("..#...#...#...#.");
-	sequencer.vecChannel[hh   ].sBeat = stringToIntArray("^.-.^.-.^._.^._^");
+	addDrumPattern(sequencer);
 
 	auto row = 0;
 	{
@@ -351,63 +369,63 @@ bool Synthesiser::OnUserUpdate(float fElapsedTime)
 		}
 	}
 	// sequenceruencer (generates notes, note offs applied by note lifespan) ======================================
-	sequencer.Update(fElapsedTime);
+	// The sequencer runs on the audio sample clock, a little ahead of what has been rendered so
+	// that its notes reach the engine before they are due even if this frame was slow
+	const auto nLookahead = static_cast<uint64_t>(dSequencerLookahead * Synth::sampleRate());
+	sequencer.Update(engine.currentSample() + nLookahead);
+	for (auto& sn : sequencer.vecNotes)
+		engine.noteTrigger(sn.pInstrument, sn.note.id, sn.note.velocity, sn.note.priority, sn.nSample);
+
+	// Keyboard instrument and volume ========================================
+	if (GetKey(olc::TAB).bPressed)
 	{
-		std::lock_guard  lock(muxNotes);
-		for (auto& note : sequencer.vecNotes)
-		{
-			note.m_Note.on = dTimeNow;
-			vecNotes.emplace_back(note);
-		}
+		// Tab selects the next instrument, after the custom ones comes the harmonica.
+		// Keys held down carry on playing the old one until they are released.
+		nKeyboardInstrument = (nKeyboardInstrument + 1) % (customInstruments.size() + 1);
+		if (nKeyboardInstrument < customInstruments.size())
+			pKeyboardInstrument = &customInstruments[nKeyboardInstrument];
+		else
+			pKeyboardInstrument = &instHarm;
+	}
+	if (GetKey(olc::UP).bPressed || GetKey(olc::DOWN).bPressed)
+	{
+		dMasterVolume += GetKey(olc::UP).bPressed ? 0.05 : -0.05;
+		dMasterVolume = std::clamp(dMasterVolume, 0.0, 1.0);
+		engine.setVolume(nullptr, dMasterVolume);
 	}
 
 	// Keyboard (generates and removes notes depending on key state) ========================================
 	// Note : olc::OEM_2 is the the /? key
 	constexpr auto Keyboard = std::to_array({ olc::Z, olc::S, olc::X, olc::C, olc::F, olc::V, olc::G, olc::B, olc::N, olc::J, olc::M, olc::K, olc::COMMA, olc::L, olc::PERIOD, olc::OEM_2 });
+	static_assert(Keyboard.size() == std::tuple_size_v<decltype(m_pHeldKeys)>);
+
+	// A key still held when its voice was stolen starts its note again
+	Synth::Command stolen;
+	while (engine.pollStolen(stolen))
+	{
+		const int k = stolen.nNoteID - Synth::BaseNoteID;
+		if (k >= 0 && k < static_cast<int>(Keyboard.size()) && m_pHeldKeys[k] == stolen.pInstrument && stolen.nPriority == nKeyboardPriority)
+			engine.post(stolen);
+	}
 
 	for (int k = 0; k < static_cast<int>(Keyboard.size()); ++k)
 	{
 		const auto key = GetKey(Keyboard[k]);
 
-		// Check if note already exists in currently playing notes
+		// The engine owns the notes, so just tell it what changed. A key pressed
+		// again while its note is releasing retriggers the note. The release goes
+		// to the instrument that started the note, even if Tab has changed it since.
+		if (key.bPressed)
 		{
-			std::lock_guard  lock(muxNotes);
-			auto noteFound = find_if(vecNotes.begin(), vecNotes.end(), [&k, pKeyboardInstrument = pKeyboardInstrument](const Synth::NoteInstrumentPtr& item) { return (item.m_Note.id == k + Synth::BaseNoteID) && (item.m_pInstrument == pKeyboardInstrument); });
-			if (noteFound == vecNotes.end())
-			{
-				// Note not found in vector
-				if (key.bHeld)
-				{
-					// Key has been pressed so create a new note
-					Synth::Note note;
-					note.id = k + Synth::BaseNoteID;
-					note.on = dTimeNow;
-					note.active = true;
-
-					// Add note to vector
-					vecNotes.emplace_back(note, pKeyboardInstrument);
-				}
-			}
-			else
-			{
-				// Note exists in vector
-				if (key.bHeld)
-				{
-					// Key is still held, so do nothing
-					if (noteFound->m_Note.off > noteFound->m_Note.on)
-					{
-						// Key has been pressed again during release phase
-						noteFound->m_Note.on = dTimeNow;
-						noteFound->m_Note.active = true;
-					}
-				}
-				else
-				{
-					// Key has been released, so switch off
-					if (noteFound->m_Note.off < noteFound->m_Note.on)
-						noteFound->m_Note.off = dTimeNow;
-				}
-			}
+			if (m_pHeldKeys[k] && m_pHeldKeys[k] != pKeyboardInstrument)
+				engine.noteOff(m_pHeldKeys[k], k + Synth::BaseNoteID);
+			engine.noteOn(pKeyboardInstrument, k + Synth::BaseNoteID, 1.0, nKeyboardPriority);
+			m_pHeldKeys[k] = pKeyboardInstrument;
+		}
+		else if (key.bReleased && m_pHeldKeys[k])
+		{
+			engine.noteOff(m_pHeldKeys[k], k + Synth::BaseNoteID);
+			m_pHeldKeys[k] = nullptr;
 		}
 	}
 
@@ -458,8 +476,9 @@ bool Synthesiser::OnUserUpdate(float fElapsedTime)
 		m_Frames = 0;
 		m_Start = dTimeNow;
 	}
-	std::string stats = "Notes: " + std::to_string(vecNotes.size()) + " Wall Time: " + std::to_string(dWallTime) + " CPU Time: " + std::to_string(dTimeNow) + " Latency: " + std::to_string(dWallTime - dTimeNow) + (m_FPS ? " FPS: " : "") + (m_FPS ? std::to_string(m_FPS) : std::string());
+	std::string stats = "Notes: " + std::to_string(engine.activeVoices()) + " Wall Time: " + std::to_string(dWallTime) + " CPU Time: " + std::to_string(dTimeNow) + " Latency: " + std::to_string(dWallTime - dTimeNow) + " Underruns: " + std::to_string(sound.GetUnderruns()) + (m_FPS ? " FPS: " : "") + (m_FPS ? std::to_string(m_FPS) : std::string());
 	DrawString(w2s(colx1, ++row), stats);
+	DrawString(w2s(colx1, ++row), "Keyboard: " + pKeyboardInstrument->name + " (Tab to change) Volume: " + std::to_string(static_cast<int>(dMasterVolume * 100 + 0.5)) + "% (Up/Down)");
 
 
 	for (auto& w : m_Windows)
@@ -471,13 +490,66 @@ bool Synthesiser::OnUserUpdate(float fElapsedTime)
 	return true;
 }
 
-int main()
+int main(int argc, char* argv[])
 {
 	// Shameless self-promotion
 	std::cout << "www.OneLoneCoder.com - Synthesizer Part 4" << std::endl 
 		      << "Multiple FM Oscillators, Sequencing, Polyphony" << std::endl << std::endl;
 
-	Synthesiser synth;
+	// Synth [--render <file.wav> [--seconds <n>] [--channels <n>] [--24bit | --float] [--song <song.json>] [--tuning <scale.scl>]] [--soft-clip] [--no-dither]
+	std::string sRenderFile;
+	std::string sSongFile;
+	std::string sTuningFile;
+	FTYPE dSeconds = 30.0;
+	unsigned int nChannels = 1;
+	auto nFormat = Synth::WAV_PCM16;
+	auto nClip = Synth::CLIP_HARD;
+	bool bDither = true;
+	for (int i = 1; i < argc; ++i)
+	{
+		const std::string_view sArg = argv[i];
+		if (sArg == "--render" && i + 1 < argc)
+			sRenderFile = argv[++i];
+		else if (sArg == "--song" && i + 1 < argc)
+			sSongFile = argv[++i];
+		else if (sArg == "--tuning" && i + 1 < argc)
+			sTuningFile = argv[++i];
+		else if (sArg == "--seconds" && i + 1 < argc)
+		{
+			if (!parseNumber(argv[++i], dSeconds) || dSeconds <= 0.0)
+			{
+				std::cerr << "--seconds needs a positive number, not " << argv[i] << std::endl;
+				return 1;
+			}
+		}
+		else if (sArg == "--channels" && i + 1 < argc)
+		{
+			int n = 0;
+			if (!parseNumber(argv[++i], n) || n < 1 || n > 8)
+			{
+				std::cerr << "--channels needs a number from 1 to 8, not " << argv[i] << std::endl;
+				return 1;
+			}
+			nChannels = static_cast<unsigned int>(n);
+		}
+		else if (sArg == "--float")
+			nFormat = Synth::WAV_FLOAT32;
+		else if (sArg == "--24bit")
+			nFormat = Synth::WAV_PCM24;
+		else if (sArg == "--soft-clip")
+			nClip = Synth::CLIP_SOFT;
+		else if (sArg == "--no-dither")
+			bDither = false;
+		else
+		{
+			std::cerr << "Usage: Synth [--render <file.wav> [--seconds <n>] [--channels <n>] [--24bit | --float] [--song <song.json>] [--tuning <scale.scl>]] [--soft-clip] [--no-dither]" << std::endl;
+			return 1;
+		}
+	}
+	if (!sRenderFile.empty())
+		return renderToFile(sRenderFile, sSongFile, sTuningFile, dSeconds, nChannels, nFormat, nClip, bDither);
+
+	Synthesiser synth(nClip, bDither);
 	if (synth.Construct(700, 400, 2, 2))
 		synth.Start();
 	return 0;
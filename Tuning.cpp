@@ -0,0 +1,199 @@
+#include "Tuning.h"
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cmath>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <sstream>
+
+namespace Synth
+{
+	namespace
+	{
+		using NoteTable = std::array<FTYPE, TuningNotes>;
+
+		// Rounds towards minus infinity, so note -1 is in the octave below note 0
+		constexpr int floorDiv(const int a, const int b)
+		{
+			return (a >= 0) ? a / b : -((-a + b - 1) / b);
+		}
+
+		// 2^(k/12) by Newton's method on x^12 = 2^k, which converges from
+		// above when started at 1 + k/12. std::pow is not constexpr.
+		constexpr double twelfthPower(const int k)
+		{
+			const double dTarget = static_cast<double>(1 << k);
+			double x = 1.0 + k / 12.0;
+			for (int i = 0; i < 32; ++i)
+			{
+				double x11 = 1.0;
+				for (int j = 0; j < 11; ++j)
+					x11 *= x;
+				x -= (x11 * x - dTarget) / (12.0 * x11);
+			}
+			return x;
+		}
+
+		constexpr NoteTable makeEqualTemperament()
+		{
+			double dSemitone[12] = {};
+			for (int k = 0; k < 12; ++k)
+				dSemitone[k] = twelfthPower(k);
+
+			NoteTable table = {};
+			for (int i = 0; i < TuningNotes; ++i)
+			{
+				const int nNote = i + TuningFirstNote;
+				const int nOctave = floorDiv(nNote, 12);
+				double dHertz = 8.0;
+				for (int o = 0; o < nOctave; ++o)
+					dHertz *= 2.0;
+				for (int o = nOctave; o < 0; ++o)
+					dHertz *= 0.5;
+				table[i] = static_cast<FTYPE>(dHertz * dSemitone[nNote - nOctave * 12]);
+			}
+			return table;
+		}
+
+		constexpr NoteTable EqualTemperament = makeEqualTemperament();
+		static_assert(EqualTemperament[-TuningFirstNote] == 8.0, "note 0 must be 8Hz");
+
+		// Read by scale() on the audio thread, so the tables are published
+		// with a single atomic store and never change or go away after that
+		std::array<std::atomic<const FTYPE*>, MaxTunings> tunings = { EqualTemperament.data() };
+		std::mutex muxTunings;
+		std::vector<std::unique_ptr<NoteTable>> vTuningStorage;
+		int nTuningCount = 1;
+
+		// A Scala pitch is in cents if it has a '.', otherwise it is a ratio
+		// like 3/2, or a whole number. Returns 0 if it is neither.
+		double parsePitch(const std::string& sPitch)
+		{
+			const char* pStart = sPitch.c_str();
+			char* pEnd = nullptr;
+			if (sPitch.find('.') != std::string::npos)
+			{
+				const double dCents = strtod(pStart, &pEnd);
+				return (pEnd != pStart && *pEnd == '\0') ? pow(2.0, dCents / 1200.0) : 0.0;
+			}
+
+			const long nNumerator = strtol(pStart, &pEnd, 10);
+			if (pEnd == pStart)
+				return 0.0;
+			long nDenominator = 1;
+			if (*pEnd == '/')
+				nDenominator = strtol(pEnd + 1, &pEnd, 10);
+			if (*pEnd != '\0' || nNumerator <= 0 || nDenominator <= 0)
+				return 0.0;
+			return static_cast<double>(nNumerator) / static_cast<double>(nDenominator);
+		}
+	}
+
+	FTYPE scale(const int nNoteID, const int nScaleID)
+	{
+		const FTYPE* pTable = EqualTemperament.data();
+		if (nScaleID > SCALE_DEFAULT && nScaleID < MaxTunings)
+		{
+			if (const FTYPE* pTuning = tunings[nScaleID].load(std::memory_order_acquire))
+				pTable = pTuning;
+		}
+
+		const int nIndex = nNoteID - TuningFirstNote;
+		if (nIndex >= 0 && nIndex < TuningNotes)
+			return pTable[nIndex];
+
+		// Far outside anything audible, but keep equal temperament exact
+		if (pTable == EqualTemperament.data())
+			return static_cast<FTYPE>(8.0 * pow(2.0, nNoteID / 12.0));
+		return pTable[std::clamp(nIndex, 0, TuningNotes - 1)];
+	}
+
+	int addTuning(const std::vector<FTYPE>& vRatios, const int nReferenceNote, const FTYPE dReferenceHertz)
+	{
+		if (vRatios.empty() || !(dReferenceHertz > 0.0))
+			return -1;
+		if (std::any_of(vRatios.begin(), vRatios.end(), [](const FTYPE r) { return !(r > 0.0); }))
+			return -1;
+
+		const int nDegrees = static_cast<int>(vRatios.size());
+		const double dPeriod = vRatios.back();
+		auto pTable = std::make_unique<NoteTable>();
+		for (int i = 0; i < TuningNotes; ++i)
+		{
+			const int nStep = i + TuningFirstNote - nReferenceNote;
+			const int nPeriods = floorDiv(nStep, nDegrees);
+			const int nDegree = nStep - nPeriods * nDegrees;
+			const double dRatio = (nDegree == 0) ? 1.0 : vRatios[nDegree - 1];
+			(*pTable)[i] = static_cast<FTYPE>(dReferenceHertz * pow(dPeriod, nPeriods) * dRatio);
+		}
+
+		std::lock_guard<std::mutex> lock(muxTunings);
+		if (nTuningCount == MaxTunings)
+			return -1;
+		tunings[nTuningCount].store(pTable->data(), std::memory_order_release);
+		vTuningStorage.push_back(std::move(pTable));
+		return nTuningCount++;
+	}
+
+	int loadTuning(const std::string& sFileName, const int nReferenceNote, const FTYPE dReferenceHertz)
+	{
+		std::ifstream file(sFileName);
+		if (!file)
+		{
+			std::cerr << "Tuning " << sFileName << ": cannot open" << '\n';
+			return -1;
+		}
+
+		// Lines starting with '!' are comments. The first other line is a
+		// description, the next the number of pitches, then one pitch a line.
+		std::vector<FTYPE> vRatios;
+		int nPitches = -1;
+		bool bDescription = true;
+		std::string sLine;
+		while ((nPitches < 0 || static_cast<int>(vRatios.size()) < nPitches) && std::getline(file, sLine))
+		{
+			if (!sLine.empty() && sLine[0] == '!')
+				continue;
+			if (bDescription)
+			{
+				bDescription = false;
+				continue;
+			}
+
+			std::string sValue;
+			std::istringstream(sLine) >> sValue;
+			if (nPitches < 0)
+			{
+				char* pEnd = nullptr;
+				nPitches = static_cast<int>(strtol(sValue.c_str(), &pEnd, 10));
+				if (pEnd == sValue.c_str() || *pEnd != '\0' || nPitches <= 0)
+				{
+					nPitches = 0;
+					break;
+				}
+				continue;
+			}
+
+			const double dRatio = parsePitch(sValue);
+			if (dRatio <= 0.0)
+				break;
+			vRatios.push_back(static_cast<FTYPE>(dRatio));
+		}
+
+		if (nPitches <= 0 || static_cast<int>(vRatios.size()) != nPitches)
+		{
+			std::cerr << "Tuning " << sFileName << ": not a valid Scala file" << '\n';
+			return -1;
+		}
+
+		const int nScaleID = addTuning(vRatios, nReferenceNote, dReferenceHertz);
+		if (nScaleID < 0)
+			std::cerr << "Tuning " << sFileName << ": cannot add tuning" << '\n';
+		return nScaleID;
+	}
+}
@@ -0,0 +1,31 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include "Synth.h"
+
+namespace Synth
+{
+	//////////////////////////////////////////////////////////////////////////////
+	// Tunings
+	//
+	// scale() reads note frequencies from a table per tuning. Tuning
+	// SCALE_DEFAULT is 12 tone equal temperament with note 0 at 8Hz, built at
+	// compile time. Others are added at runtime and get the next free ID;
+	// they are never removed, so an ID stays valid for the life of the program.
+
+	constexpr int TuningFirstNote = -64;	// Lowest note ID with a table entry
+	constexpr int TuningNotes = 256;
+	constexpr int MaxTunings = 16;
+
+	// Adds a tuning from the ratios of each scale degree to the first, which
+	// is 1/1 and not listed. The last ratio is the period the scale repeats
+	// at, 2.0 for an octave. Note nReferenceNote plays at dReferenceHertz.
+	// Returns the new scale ID, or -1 if the ratios are unusable or all IDs
+	// are taken.
+	int addTuning(const std::vector<FTYPE>& vRatios, const int nReferenceNote = 0, const FTYPE dReferenceHertz = 8.0);
+
+	// Adds a tuning from a Scala .scl file, see addTuning()
+	int loadTuning(const std::string& sFileName, const int nReferenceNote = 0, const FTYPE dReferenceHertz = 8.0);
+}
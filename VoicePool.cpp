@@ -0,0 +1,41 @@
+#include "VoicePool.h"
+
+#include <assert.h>
+
+namespace Synth
+{
+	VoicePool::VoicePool(const size_t nCapacity)
+		: m_Voices(nCapacity)
+		, m_Position(nCapacity)
+	{
+		// Neither list ever holds more than nCapacity slots, so neither reallocates after this
+		m_Active.reserve(nCapacity);
+		m_Free.reserve(nCapacity);
+		for (size_t i = nCapacity; i > 0; --i)
+			m_Free.push_back(i - 1);
+	}
+
+	NoteInstrumentPtr* VoicePool::allocate()
+	{
+		if (m_Free.empty())
+			return nullptr;
+
+		const size_t nSlot = m_Free.back();
+		m_Free.pop_back();
+		m_Position[nSlot] = m_Active.size();
+		m_Active.push_back(nSlot);
+
+		auto& voice = m_Voices[nSlot];
+		voice = NoteInstrumentPtr{};
+		return &voice;
+	}
+
+	void VoicePool::release(const size_t n)
+	{
+		assert(n < m_Active.size());
+		m_Free.push_back(m_Active[n]);
+		m_Active[n] = m_Active.back();
+		m_Position[m_Active[n]] = n;
+		m_Active.pop_back();
+	}
+}
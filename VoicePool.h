@@ -0,0 +1,44 @@
+#pragma once
+
+#include <vector>
+
+#include "Synth.h"
+
+namespace Synth
+{
+	// Fixed capacity store for the playing voices. All of the memory is allocated
+	// by the constructor, and allocate() and release() are O(1) and never allocate,
+	// so they are safe to call from the audio thread. A voice stays in the same
+	// slot for as long as it plays.
+	class VoicePool
+	{
+	public:
+		explicit VoicePool(const size_t nCapacity);
+
+		size_t capacity() const { return m_Voices.size(); }
+		size_t size() const { return m_Active.size(); }
+		bool full() const { return m_Active.size() == m_Voices.size(); }
+
+		// Takes a free voice, resets it, and appends it to the active voices.
+		// Returns nullptr if every voice is in use.
+		NoteInstrumentPtr* allocate();
+
+		// Frees the nth active voice. The last active voice takes its place.
+		void release(const size_t n);
+
+		// The nth active voice, for 0 <= n < size()
+		NoteInstrumentPtr& operator[](const size_t n) { return m_Voices[m_Active[n]]; }
+		const NoteInstrumentPtr& operator[](const size_t n) const { return m_Voices[m_Active[n]]; }
+
+		// The slot of the nth active voice, and back again. Unlike n, the slot
+		// does not change when other voices are released.
+		size_t slot(const size_t n) const { return m_Active[n]; }
+		size_t position(const size_t nSlot) const { return m_Position[nSlot]; }
+
+	private:
+		std::vector<NoteInstrumentPtr> m_Voices;
+		std::vector<size_t> m_Active;	// Slots of the playing voices
+		std::vector<size_t> m_Free;		// Slots available to allocate()
+		std::vector<size_t> m_Position;	// Where each playing slot is in m_Active
+	};
+}
@@ -0,0 +1,119 @@
+#include "Wavetable.h"
+
+#include <algorithm>
+#include <assert.h>
+#include <cmath>
+#include <map>
+#include <memory>
+#include <mutex>
+
+namespace Synth
+{
+	namespace
+	{
+		constexpr auto PI = 3.14159265354;
+
+		// Amplitude of the nth harmonic, matching the normalisation of oscillator()
+		FTYPE harmonicAmplitude(const WaveType nType, const int n)
+		{
+			switch (nType)
+			{
+			case OSC_SAW_ANA:
+				return (2.0 / PI) / n;
+			default:
+				break;
+			}
+
+			assert(false);
+			return 0.0;
+		}
+
+		const std::vector<FTYPE>& sineTable()
+		{
+			static const std::vector<FTYPE> table = []()
+			{
+				std::vector<FTYPE> t(Wavetable::TableSize);
+				for (int i = 0; i < Wavetable::TableSize; ++i)
+					t[i] = sin(2.0 * PI * i / Wavetable::TableSize);
+				return t;
+			}();
+			return table;
+		}
+	}
+
+	Wavetable::Wavetable(const WaveType nType, const int nHarmonics)
+		: m_nHarmonics(std::clamp(nHarmonics, 0, MaxHarmonics))
+	{
+		// sin(2 pi n i / N) is entry (n * i) mod N of a single sine table, so
+		// building the levels needs no further calls to sin()
+		const auto& sine = sineTable();
+		int nLevelHarmonics = m_nHarmonics;
+		do
+		{
+			std::vector<FTYPE> level(TableSize + 1, 0.0);
+			for (int n = 1; n <= nLevelHarmonics; ++n)
+			{
+				const FTYPE dAmp = harmonicAmplitude(nType, n);
+				if (dAmp == 0.0)
+					continue;
+				for (int i = 0; i < TableSize; ++i)
+					level[i] += dAmp * sine[(n * i) % TableSize];
+			}
+			level[TableSize] = level[0];
+
+			// Summed at full precision, stored at the precision it is played at
+			auto& stored = m_Levels.emplace_back(TableSize + 1);
+			for (int i = 0; i <= TableSize; ++i)
+				stored[i] = static_cast<STYPE>(level[i]);
+			nLevelHarmonics /= 2;
+		} while (nLevelHarmonics > 0);
+	}
+
+	const STYPE* Wavetable::select(const FTYPE dHertz, const FTYPE dSampleRate) const
+	{
+		const FTYPE dNyquist = dSampleRate / 2.0;
+		int nLevelHarmonics = m_nHarmonics;
+		for (const auto& level : m_Levels)
+		{
+			if (nLevelHarmonics * dHertz <= dNyquist)
+				return level.data();
+			nLevelHarmonics /= 2;
+		}
+
+		// Even the fundamental is above Nyquist, nothing can be done
+		return m_Levels.back().data();
+	}
+
+	/*static*/ STYPE Wavetable::read(const STYPE* pTable, const STYPE dPhase)
+	{
+		// A phase that has rounded up to 1.0 reads the repeated first sample at the end
+		const STYPE dIndex = dPhase * TableSize;
+		const int nIndex = std::min(static_cast<int>(dIndex), TableSize - 1);
+		const STYPE dFrac = dIndex - static_cast<STYPE>(nIndex);
+		return pTable[nIndex] + dFrac * (pTable[nIndex + 1] - pTable[nIndex]);
+	}
+
+	const Wavetable* getWavetable(const WaveType nType, const FTYPE dCustom)
+	{
+		int nHarmonics = 0;
+		switch (nType)
+		{
+		case OSC_SAW_ANA:
+			// oscillator() sums the harmonics n = 1, 2, ... while n < dCustom
+			nHarmonics = std::max(static_cast<int>(ceil(dCustom)) - 1, 0);
+			break;
+		default:
+			return nullptr;
+		}
+		nHarmonics = std::min(nHarmonics, Wavetable::MaxHarmonics);
+
+		static std::mutex mux;
+		static std::map<std::pair<WaveType, int>, std::unique_ptr<Wavetable>> tables;
+
+		std::lock_guard lock(mux);
+		auto& pTable = tables[{ nType, nHarmonics }];
+		if (!pTable)
+			pTable = std::make_unique<Wavetable>(nType, nHarmonics);
+		return pTable.get();
+	}
+}
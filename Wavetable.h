@@ -0,0 +1,44 @@
+#pragma once
+
+#include <vector>
+
+#include "Synth.h"
+
+namespace Synth
+{
+	//////////////////////////////////////////////////////////////////////////////
+	// Band-limited wavetables
+	//
+	// A single cycle of a waveform, pre-rendered from its harmonic series at a
+	// number of levels. Level 0 holds all of the harmonics, and each following
+	// level holds half as many, so each level can play notes an octave higher
+	// than the one before it without any harmonic going above Nyquist.
+
+	class Wavetable
+	{
+	public:
+		static constexpr int TableSize = 4096;
+		static constexpr int MaxHarmonics = TableSize / 2 - 1;
+
+		// Only OSC_SAW_ANA is built from its harmonics, see getWavetable()
+		Wavetable(const WaveType nType, const int nHarmonics);
+
+		// Returns the richest table that has no harmonics above Nyquist for dHertz
+		const STYPE* select(const FTYPE dHertz, const FTYPE dSampleRate) const;
+
+		// Linearly interpolated lookup, dPhase is in cycles [0, 1)
+		static STYPE read(const STYPE* pTable, const STYPE dPhase);
+
+		int harmonics() const { return m_nHarmonics; }
+
+	private:
+		int m_nHarmonics;
+		std::vector<std::vector<STYPE>> m_Levels; // TableSize + 1 samples each, the last repeats the first
+	};
+
+	// Returns the shared wavetable for nType, building it the first time it is asked for.
+	// For OSC_SAW_ANA, dCustom has the same meaning as in oscillator().
+	// Returns nullptr for waveforms that are not rendered from a table; square,
+	// triangle and digital saw are anti-aliased by the oscillator instead.
+	const Wavetable* getWavetable(const WaveType nType, const FTYPE dCustom = 50);
+}
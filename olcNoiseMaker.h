@@ -39,7 +39,8 @@
 	1.0 - 14/01/17
 	- Controls audio output hardware behind the scenes so you can just focus
 	  on creating and listening to interesting waveforms.
-	- Currently MS Windows only
+	- Output goes through an AudioBackend: winmm on Windows, ALSA on Linux,
+	  or the "null" and "file:<path>" devices anywhere
 
 	Documentation
 	~~~~~~~~~~~~~
@@ -53,21 +54,29 @@
 
 #pragma once
 
-#pragma comment(lib, "winmm.lib")
+#include "AudioBackend.h"
+#include "OutputStage.h"
 
 #include <iostream>
 #include <cmath>
 #include <fstream>
 #include <vector>
 #include <string>
+#include <memory>
 #include <thread>
 #include <atomic>
-#include <condition_variable>
+#include <cstdint>
+#include <type_traits>
 
 #ifndef FTYPE
 #define FTYPE double
 #endif
 
+// Type of the audio sample buffers, see Synth.h
+#ifndef STYPE
+#define STYPE double
+#endif
+
 const double PI = 2.0 * acos(0.0);
 
 template<class T>
@@ -84,72 +93,55 @@ public:
 		unsigned int nSampleRate = 44100,
 		unsigned int nChannels = 1,
 		unsigned int nBlocks = 8,
-		unsigned int nBlockSamples = 512)
+		unsigned int nBlockSamples = 512,
+		Synth::ClipType nClip = Synth::CLIP_HARD,
+		bool bDither = true)
 	{
 		m_OutputDevice = sOutputDevice;
 		m_nSampleRate = nSampleRate;
 		m_nChannels = nChannels;
 		m_nBlockCount = nBlocks;
 		m_nBlockSamples = nBlockSamples;
-		m_nBlockFree = nBlocks;
 		m_bReady = false;
 		m_nBlockCurrent = 0;
-		m_pBlockMemory = nullptr;
-		m_pWaveHeaders = nullptr;
 		m_userFunction = nullptr;
+		m_userBlockFunction = nullptr;
+		m_vBlockMix.assign(m_nBlockSamples, 0.0);
 
-		// Validate device
-		std::vector<std::string> devices = Enumerate();
-		auto d = std::find(devices.begin(), devices.end(), m_OutputDevice);
-		if (d != devices.end())
-		{
-			// Device is available
-			auto nDeviceID = distance(devices.begin(), d);
-			WAVEFORMATEX waveFormat;
-			waveFormat.wFormatTag = WAVE_FORMAT_PCM;
-			waveFormat.nSamplesPerSec = m_nSampleRate;
-			waveFormat.wBitsPerSample = sizeof(T) * 8;
-			waveFormat.nChannels = static_cast<WORD>(m_nChannels);
-			waveFormat.nBlockAlign = (waveFormat.wBitsPerSample / 8) * waveFormat.nChannels;
-			waveFormat.nAvgBytesPerSec = waveFormat.nSamplesPerSec * waveFormat.nBlockAlign;
-			waveFormat.cbSize = 0;
-
-			// Open Device if valid
-			if (waveOutOpen(&m_hwDevice, static_cast<unsigned int>(nDeviceID), &waveFormat, (DWORD_PTR)waveOutProcWrap, (DWORD_PTR)this, CALLBACK_FUNCTION) != S_OK)
-				return Destroy();
-		}
-
-		// Allocate Wave|Block Memory
-		m_pBlockMemory = new T[m_nBlockCount * m_nBlockSamples];
-		if (m_pBlockMemory == nullptr)
+		m_pBackend = Synth::makeAudioBackend(m_OutputDevice);
+		if (!m_pBackend)
 			return Destroy();
-		ZeroMemory(m_pBlockMemory, sizeof(T) * m_nBlockCount * m_nBlockSamples);
 
-		m_pWaveHeaders = new WAVEHDR[m_nBlockCount];
-		if (m_pWaveHeaders == nullptr)
+		// Allocate Wave|Block Memory
+		m_vBlockMemory.assign(m_nBlockCount * m_nBlockSamples, 0);
+
+		Synth::AudioFormat format;
+		format.nSampleRate = m_nSampleRate;
+		format.nChannels = m_nChannels;
+		format.nBitsPerSample = sizeof(T) * 8;
+		format.bFloat = std::is_floating_point_v<T>;
+		format.nBlocks = m_nBlockCount;
+		format.nBlockSamples = m_nBlockSamples;
+		if (!Synth::OutputStage::supports(format) || !m_pBackend->open(format, m_vBlockMemory.data()))
 			return Destroy();
-		ZeroMemory(m_pWaveHeaders, sizeof(WAVEHDR) * m_nBlockCount);
-
-		// Link headers to block memory
-		for (unsigned int n = 0; n < m_nBlockCount; n++)
-		{
-			m_pWaveHeaders[n].dwBufferLength = m_nBlockSamples * sizeof(T);
-			m_pWaveHeaders[n].lpData = (LPSTR)(m_pBlockMemory + (n * m_nBlockSamples));
-		}
+		m_Output = Synth::OutputStage(format, nClip, bDither);
 
 		m_bReady = true;
 
 		m_thread = std::thread(&olcNoiseMaker::MainThread, this);
 
-		// Start the ball rolling
-		std::unique_lock<std::mutex> lm(m_muxBlockNotZero);
-		m_cvBlockNotZero.notify_one();
-
 		return true;
 	}
 
 	bool Destroy()
 	{
+		if (m_thread.joinable())
+			Stop();
+		if (m_pBackend)
+		{
+			m_pBackend->close();
+			m_pBackend.reset();
+		}
 		return false;
 	}
 
@@ -165,9 +157,22 @@ public:
 		return 0.0;
 	}
 
+	// Time in seconds of the start of the most recently filled block
 	FTYPE GetTime()
 	{
-		return m_dGlobalTime;
+		return static_cast<FTYPE>(m_nSampleClock.load(std::memory_order_acquire)) / static_cast<FTYPE>(m_nSampleRate);
+	}
+
+	// Blocks that reached the output too late to play on time
+	uint64_t GetUnderruns()
+	{
+		return m_pBackend ? m_pBackend->underruns() : 0;
+	}
+
+	// Number of frames filled so far
+	uint64_t GetSampleClock()
+	{
+		return m_nSampleClock.load(std::memory_order_acquire);
 	}
 
 	
@@ -175,13 +180,7 @@ public:
 public:
 	static std::vector<std::string> Enumerate()
 	{
-		int nDeviceCount = waveOutGetNumDevs();
-		std::vector<std::string> sDevices;
-		WAVEOUTCAPS woc;
-		for (int n = 0; n < nDeviceCount; n++)
-			if (waveOutGetDevCaps(n, &woc, sizeof(WAVEOUTCAPS)) == S_OK)
-				sDevices.push_back(woc.szPname);
-		return sDevices;
+		return Synth::audioDevices();
 	}
 
 	void SetUserFunction(FTYPE(*func)(int, FTYPE))
@@ -189,17 +188,20 @@ public:
 		m_userFunction = func;
 	}
 
-	FTYPE clip(FTYPE dSample, FTYPE dMax)
+	// Alternative to SetUserFunction(). The function is called once per block and
+	// fills nFrames frames of nChannels interleaved samples, the first at sample
+	// clock time nSample.
+	void SetUserBlockFunction(void(*func)(STYPE* pOutput, unsigned int nFrames, unsigned int nChannels, uint64_t nSample))
 	{
-		if (dSample >= 0.0)
-			return fmin(dSample, dMax);
-		else
-			return fmax(dSample, -dMax);
+		m_userBlockFunction = func;
 	}
 
 
 private:
 	FTYPE(*m_userFunction)(int, FTYPE) = nullptr;
+	void(*m_userBlockFunction)(STYPE*, unsigned int, unsigned int, uint64_t) = nullptr;
+	std::vector<STYPE> m_vBlockMix;
+	Synth::OutputStage m_Output;
 
 	std::string m_OutputDevice;
 	unsigned int m_nSampleRate = 0;
@@ -208,88 +210,59 @@ private:
 	unsigned int m_nBlockSamples = 0;
 	unsigned int m_nBlockCurrent = 0;
 
-	T* m_pBlockMemory = nullptr;
-	WAVEHDR *m_pWaveHeaders = nullptr;
-	HWAVEOUT m_hwDevice;
+	std::vector<T> m_vBlockMemory;
+	std::unique_ptr<Synth::AudioBackend> m_pBackend;
 
 	std::thread m_thread;
 	std::atomic<bool> m_bReady = false;
-	std::atomic<unsigned int> m_nBlockFree;
-	std::condition_variable m_cvBlockNotZero;
-	std::mutex m_muxBlockNotZero;
-
-	std::atomic<FTYPE> m_dGlobalTime;
-
-	// Handler for soundcard request for more data
-	void waveOutProc(HWAVEOUT /*hWaveOut*/, UINT uMsg, DWORD /*dwParam1*/, DWORD /*dwParam2*/)
-	{
-		if (uMsg != WOM_DONE) return;
-
-		m_nBlockFree++;
-		std::unique_lock<std::mutex> lm(m_muxBlockNotZero);
-		m_cvBlockNotZero.notify_one();
-	}
 
-	// Static wrapper for sound card handler
-	static void CALLBACK waveOutProcWrap(HWAVEOUT hWaveOut, UINT uMsg, DWORD_PTR dwInstance, DWORD dwParam1, DWORD dwParam2)
-	{
-		((olcNoiseMaker*)dwInstance)->waveOutProc(hWaveOut, uMsg, dwParam1, dwParam2);
-	}
+	// Master clock, counted in frames so it never drifts. Published once per block.
+	std::atomic<uint64_t> m_nSampleClock = 0;
 
-	// Main thread. This loop responds to requests from the soundcard to fill 'blocks'
-	// with audio data. If no requests are available it goes dormant until the sound
-	// card is ready for more data. The block is filled by the "user" in some manner
-	// and then issued to the soundcard.
+	// Main thread. This loop responds to requests from the backend to fill 'blocks'
+	// with audio data. If no requests are available it goes dormant until the backend
+	// is ready for more data. The block is filled by the "user" in some manner
+	// and then issued to the backend.
 	void MainThread()
 	{
-		m_dGlobalTime = 0.0;
-		FTYPE dTimeStep = 1.0 / (FTYPE)m_nSampleRate;
-
-		// Goofy hack to get maximum integer for a type at run-time
-		T nMaxSample = (T)pow(2, (sizeof(T) * 8) - 1) - 1;
-		FTYPE dMaxSample = (FTYPE)nMaxSample;
-		T nPreviousSample = 0;
+		uint64_t nSampleClock = 0;
+		m_nSampleClock.store(nSampleClock, std::memory_order_release);
+		const FTYPE dSampleRate = (FTYPE)m_nSampleRate;
+		const unsigned int nFrames = m_nBlockSamples / m_nChannels;
 
 		while (m_bReady)
 		{
 			// Wait for block to become available
-			if (m_nBlockFree == 0)
+			m_pBackend->waitForBlock(m_nBlockCurrent);
+
+			if (m_userBlockFunction != nullptr)
 			{
-				std::unique_lock<std::mutex> lm(m_muxBlockNotZero);
-				while(m_nBlockFree == 0) // sometimes, Windows signals incorrectly
-					m_cvBlockNotZero.wait(lm);
+				// Whole block of frames in one call, already interleaved
+				m_userBlockFunction(m_vBlockMix.data(), nFrames, m_nChannels, nSampleClock);
 			}
-
-			// Block is here, so use it
-			m_nBlockFree--;
-
-			// Prepare block for processing
-			if (m_pWaveHeaders[m_nBlockCurrent].dwFlags & WHDR_PREPARED)
-				waveOutUnprepareHeader(m_hwDevice, &m_pWaveHeaders[m_nBlockCurrent], sizeof(WAVEHDR));
-
-			T nNewSample = 0;
-			int nCurrentBlock = m_nBlockCurrent * m_nBlockSamples;
-			
-			for (unsigned int n = 0; n < m_nBlockSamples; n+=m_nChannels)
+			else
 			{
-				// User Process
-				for (unsigned int c = 0; c < m_nChannels; c++)
+				for (unsigned int f = 0; f < nFrames; f++)
 				{
-					if (m_userFunction == nullptr)
-						nNewSample = (T)(clip(UserProcess(c, m_dGlobalTime), 1.0) * dMaxSample);
-					else
-						nNewSample = (T)(clip(m_userFunction(c, m_dGlobalTime), 1.0) * dMaxSample);
-					
-					m_pBlockMemory[nCurrentBlock + n + c] = nNewSample;
-					nPreviousSample = nNewSample;
+					const FTYPE dTime = static_cast<FTYPE>(nSampleClock + f) / dSampleRate;
+
+					// User Process
+					for (unsigned int c = 0; c < m_nChannels; c++)
+					{
+						const FTYPE dSample = (m_userFunction == nullptr) ? UserProcess(c, dTime) : m_userFunction(c, dTime);
+						m_vBlockMix[f * m_nChannels + c] = static_cast<STYPE>(dSample);
+					}
 				}
-				
-				m_dGlobalTime = m_dGlobalTime + dTimeStep;
 			}
+			nSampleClock += nFrames;
+
+			// Clip, dither and convert the whole block at once
+			m_Output.process(m_vBlockMix.data(), &m_vBlockMemory[m_nBlockCurrent * m_nBlockSamples], nFrames * m_nChannels);
+			m_nSampleClock.store(nSampleClock, std::memory_order_release);
 
 			// Send block to sound device
-			waveOutPrepareHeader(m_hwDevice, &m_pWaveHeaders[m_nBlockCurrent], sizeof(WAVEHDR));
-			waveOutWrite(m_hwDevice, &m_pWaveHeaders[m_nBlockCurrent], sizeof(WAVEHDR));
+			if (!m_pBackend->submit(m_nBlockCurrent))
+				m_bReady = false;
 			m_nBlockCurrent++;
 			m_nBlockCurrent %= m_nBlockCount;
 		}